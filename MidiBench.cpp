@@ -0,0 +1,554 @@
+
+#include "MidiBench.hpp"
+#include "MidiFile.hpp"
+#include "MidiFileMapping.hpp"
+#include "MidiNoteIndex.hpp"
+#include "MidiNotePairer.hpp"
+#include "MidiScan.hpp"
+#include "MidiTrackDecoder.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <ostream>
+#include <span>
+#include <sstream>
+#include <thread>
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
+
+// Heap counting. Every form of operator new and delete is replaced - plain, array,
+// nothrow, sized and aligned - so whatever allocates goes through the same malloc/free
+// pair that frees it. While midi_alloc_count_start() is in effect on a thread, that
+// thread's allocations are counted into thread locals. Anywhere else this costs one
+// thread local load per call. Sizes are the allocator's usable size of the block, so an
+// unsized delete counts the same as the new it undoes.
+namespace {
+    struct HeapCounter {
+        bool        counting = false;
+        uint64_t    allocations = 0;
+        int64_t     in_use = 0;     // since counting started - frees of older blocks take it below 0
+        int64_t     peak = 0;
+    };
+    thread_local HeapCounter heap_counter;
+
+    constexpr size_t default_alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+    size_t block_size(void* p, size_t alignment) {
+#if defined(_WIN32)
+        return alignment > default_alignment ? _aligned_msize(p, alignment, 0) : _msize(p);
+#elif defined(__APPLE__)
+        (void)alignment;
+        return malloc_size(p);
+#else
+        (void)alignment;
+        return malloc_usable_size(p);
+#endif
+    }
+
+    void* heap_allocate(size_t size, size_t alignment) {
+        if (size == 0)
+            size = 1; // every new returns a distinct pointer
+        void* p = nullptr;
+#if defined(_WIN32)
+        p = alignment > default_alignment ? _aligned_malloc(size, alignment) : std::malloc(size);
+#else
+        if (alignment > default_alignment) {
+            if (posix_memalign(&p, alignment, size) != 0)
+                p = nullptr;
+        }
+        else
+            p = std::malloc(size);
+#endif
+        HeapCounter& c = heap_counter;
+        if (p && c.counting) {
+            ++c.allocations;
+            c.in_use += static_cast<int64_t>(block_size(p, alignment));
+            c.peak = std::max(c.peak, c.in_use);
+        }
+        return p;
+    }
+
+    void heap_free(void* p, size_t alignment) noexcept {
+        if (!p)
+            return;
+        HeapCounter& c = heap_counter;
+        if (c.counting)
+            c.in_use -= static_cast<int64_t>(block_size(p, alignment));
+#if defined(_WIN32)
+        if (alignment > default_alignment) {
+            _aligned_free(p);
+            return;
+        }
+#endif
+        std::free(p);
+    }
+
+    // What a throwing operator new has to do: ask the new handler for memory until it
+    // gives up
+    void* heap_allocate_or_throw(size_t size, size_t alignment) {
+        for (;;) {
+            if (void* p = heap_allocate(size, alignment))
+                return p;
+            std::new_handler handler = std::get_new_handler();
+            if (!handler)
+                throw std::bad_alloc();
+            handler();
+        }
+    }
+
+    void* heap_allocate_nothrow(size_t size, size_t alignment) noexcept {
+        try {
+            return heap_allocate_or_throw(size, alignment);
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+}
+
+void* operator new(size_t size) { return heap_allocate_or_throw(size, default_alignment); }
+void* operator new[](size_t size) { return heap_allocate_or_throw(size, default_alignment); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return heap_allocate_nothrow(size, default_alignment); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return heap_allocate_nothrow(size, default_alignment); }
+void* operator new(size_t size, std::align_val_t al) { return heap_allocate_or_throw(size, size_t(al)); }
+void* operator new[](size_t size, std::align_val_t al) { return heap_allocate_or_throw(size, size_t(al)); }
+void* operator new(size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return heap_allocate_nothrow(size, size_t(al)); }
+void* operator new[](size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return heap_allocate_nothrow(size, size_t(al)); }
+
+void operator delete(void* p) noexcept { heap_free(p, default_alignment); }
+void operator delete[](void* p) noexcept { heap_free(p, default_alignment); }
+void operator delete(void* p, size_t) noexcept { heap_free(p, default_alignment); }
+void operator delete[](void* p, size_t) noexcept { heap_free(p, default_alignment); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { heap_free(p, default_alignment); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { heap_free(p, default_alignment); }
+void operator delete(void* p, std::align_val_t al) noexcept { heap_free(p, size_t(al)); }
+void operator delete[](void* p, std::align_val_t al) noexcept { heap_free(p, size_t(al)); }
+void operator delete(void* p, size_t, std::align_val_t al) noexcept { heap_free(p, size_t(al)); }
+void operator delete[](void* p, size_t, std::align_val_t al) noexcept { heap_free(p, size_t(al)); }
+void operator delete(void* p, std::align_val_t al, const std::nothrow_t&) noexcept { heap_free(p, size_t(al)); }
+void operator delete[](void* p, std::align_val_t al, const std::nothrow_t&) noexcept { heap_free(p, size_t(al)); }
+
+void midi_alloc_count_start() {
+    heap_counter = HeapCounter{ true };
+}
+
+MidiAllocStats midi_alloc_count_stop() {
+    HeapCounter& c = heap_counter;
+    c.counting = false;
+    return { c.allocations, static_cast<uint64_t>(c.peak) };
+}
+
+
+namespace {
+
+    // splitmix64 - std's distributions differ between standard libraries, this doesn't
+    struct Rng {
+        uint64_t state;
+
+        uint64_t next() {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+        uint32_t below(uint32_t n) { return static_cast<uint32_t>(((next() >> 32) * n) >> 32); }
+        bool chance(double p) { return (next() >> 11) * 0x1.0p-53 < p; }
+    };
+
+    void put(std::vector<std::byte>& out, std::initializer_list<uint8_t> bytes) {
+        for (uint8_t b : bytes)
+            out.push_back(std::byte{ b });
+    }
+
+    void put_vlq(std::vector<std::byte>& out, uint32_t v) {
+        uint8_t buf[5];
+        size_t n = 0;
+        do {
+            buf[n++] = v & 0x7F;
+            v >>= 7;
+        } while (v);
+        while (n-- > 1)
+            out.push_back(std::byte(buf[n] | 0x80));
+        out.push_back(std::byte(buf[0]));
+    }
+
+    void put_32(std::vector<std::byte>& out, uint32_t v) {
+        put(out, { uint8_t(v >> 24), uint8_t(v >> 16), uint8_t(v >> 8), uint8_t(v) });
+    }
+
+    std::vector<std::byte> synth_track(Rng& rng, const MidiSynthOptions& o, uint16_t trk) {
+        std::vector<std::byte> t;
+        if (trk == 0) {
+            put(t, { 0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20 });       // 120 bpm
+            put(t, { 0x00, 0xFF, 0x58, 0x04, 0x04, 0x02, 0x18, 0x08 }); // 4/4
+        }
+
+        // notes held per channel, so every note on gets its note off
+        std::array<std::vector<uint8_t>, 16> held;
+        uint8_t prev_status = 0;
+
+        for (uint32_t e = 0; e < o.events_per_track; ++e) {
+            // mostly chords and short steps, now and then a gap long enough for 3 VLQ bytes
+            uint32_t delta = rng.chance(0.3) ? 0 : rng.chance(0.01) ? 20000 + rng.below(100000) : 1 + rng.below(240);
+            put_vlq(t, delta);
+
+            if (rng.chance(o.sysex_meta)) {
+                uint32_t length = 4 + rng.below(60);
+                if (rng.chance(0.5)) {
+                    put(t, { 0xF0 });
+                    put_vlq(t, length + 1);
+                    for (uint32_t i = 0; i < length; ++i)
+                        put(t, { uint8_t(rng.below(128)) });
+                    put(t, { 0xF7 });
+                }
+                else {
+                    put(t, { 0xFF, 0x01 });
+                    put_vlq(t, length);
+                    for (uint32_t i = 0; i < length; ++i)
+                        put(t, { uint8_t('a' + rng.below(26)) });
+                }
+                prev_status = 0;
+                continue;
+            }
+
+            uint8_t status = prev_status;
+            bool running = prev_status && rng.chance(o.running_status);
+            if (!running) {
+                uint32_t kind = rng.below(100);
+                uint8_t channel = uint8_t((trk + rng.below(4)) & 0x0F);
+                status = uint8_t((kind < 85 ? 0x90 : kind < 95 ? 0xB0 : kind < 98 ? 0xE0 : 0xC0) | channel);
+                put(t, { status });
+            }
+            prev_status = status;
+
+            switch (status & 0xF0) {
+            case 0x90: {
+                // a note off is a note on with velocity 0, so running status covers both
+                auto& notes = held[status & 0x0F];
+                if (!notes.empty() && (notes.size() >= 8 || rng.chance(0.5))) {
+                    size_t i = rng.below(static_cast<uint32_t>(notes.size()));
+                    put(t, { notes[i], 0 });
+                    notes.erase(notes.begin() + i);
+                }
+                else {
+                    uint8_t pitch = uint8_t(36 + rng.below(60));
+                    notes.push_back(pitch);
+                    put(t, { pitch, uint8_t(1 + rng.below(127)) });
+                }
+                break;
+            }
+            case 0xB0:
+                put(t, { uint8_t(rng.below(120)), uint8_t(rng.below(128)) });
+                break;
+            case 0xE0:
+                put(t, { uint8_t(rng.below(128)), uint8_t(rng.below(128)) });
+                break;
+            default:
+                put(t, { uint8_t(rng.below(128)) });
+                break;
+            }
+        }
+
+        for (uint8_t ch = 0; ch < held.size(); ++ch)
+            for (uint8_t pitch : held[ch])
+                put(t, { 0x00, uint8_t(0x80 | ch), pitch, 0x40 });
+        put(t, { 0x00, 0xFF, 0x2F, 0x00 });
+        return t;
+    }
+}
+
+std::vector<std::byte> midi_synthesize(const MidiSynthOptions& options) {
+    Rng rng{ options.seed };
+
+    std::vector<std::byte> out;
+    put(out, { 'M', 'T', 'h', 'd', 0, 0, 0, 6 });
+    uint16_t format = options.num_tracks > 1 ? 1 : 0;
+    put(out, { uint8_t(format >> 8), uint8_t(format), uint8_t(options.num_tracks >> 8), uint8_t(options.num_tracks),
+               uint8_t(options.ppqn >> 8), uint8_t(options.ppqn) });
+
+    for (uint16_t trk = 0; trk < options.num_tracks; ++trk) {
+        auto track = synth_track(rng, options, trk);
+        put(out, { 'M', 'T', 'r', 'k' });
+        put_32(out, static_cast<uint32_t>(track.size()));
+        out.insert(out.end(), track.begin(), track.end());
+    }
+    return out;
+}
+
+
+namespace {
+
+    volatile uint64_t bench_sink = 0; // keeps results the optimizer would like to throw away
+
+    struct BenchResult {
+        std::string operation;
+        std::string input;
+        uint64_t    bytes = 0;      // input bytes per iteration, 0 where it doesn't apply
+        uint64_t    items = 0;      // events, notes or queries per iteration
+        uint64_t    iterations = 0;
+        double      seconds = 0.0;  // per iteration
+        uint64_t    allocations = 0;
+        uint64_t    peak_bytes = 0;
+        uint64_t    arena_bytes = 0;    // parses only: what the tracks use of the arena the peak includes
+    };
+
+    // Doubles the iteration count until a round takes min_seconds, best of three rounds.
+    // Then one more run, alone, for the heap numbers.
+    template <typename Op>
+    BenchResult measure(const char* operation, const std::string& input, uint64_t bytes, uint64_t items,
+                        double min_seconds, Op&& op) {
+        BenchResult r{ operation, input, bytes, items };
+
+        uint64_t iterations = 1;
+        double best = 1e300;
+        for (int round = 0; round < 3; ++round) {
+            for (;;) {
+                auto start = std::chrono::steady_clock::now();
+                for (uint64_t i = 0; i < iterations; ++i)
+                    op();
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (elapsed >= min_seconds) {
+                    best = std::min(best, elapsed / iterations);
+                    break;
+                }
+                iterations *= 2;
+            }
+        }
+        r.iterations = iterations;
+        r.seconds = best;
+
+        midi_alloc_count_start();
+        op();
+        MidiAllocStats heap = midi_alloc_count_stop();
+        r.allocations = heap.allocations;
+        r.peak_bytes = heap.peak_bytes;
+        return r;
+    }
+
+    void bench_input(const std::string& input, std::span<const std::byte> bytes, const MidiBenchOptions& options,
+                     std::vector<BenchResult>& results) {
+        MidiParseOptions full;
+        MidiParseOptions notes_only = full;
+        notes_only.full_fidelity = false;
+
+        MidiFile midi(bytes, full);
+        auto tracks = midi.midi_tracks_view();
+        uint64_t events = 0;
+        uint64_t notes = 0;
+        uint64_t note_events = 0;
+        for (const auto& t : tracks) {
+            events += t.event_count();
+            notes += t.notes.size();
+            for (const auto& e : t.events)
+                note_events += e.event == MidiEvent::EventType::NoteOn || e.event == MidiEvent::EventType::NoteOff;
+        }
+        double min_seconds = options.min_seconds;
+
+        // The heap peak of a parse is mostly its arena, reserved up front - what the tracks
+        // really take of it goes in the report next to it
+        uint64_t arena_used = 0;
+        auto with_arena = [&arena_used](BenchResult r) {
+            r.arena_bytes = arena_used;
+            return r;
+        };
+
+        results.push_back(with_arena(measure("parse", input, bytes.size(), events, min_seconds, [&] {
+            MidiFile m(bytes, full);
+            bench_sink = bench_sink + m.tempo_map().segments().size();
+            arena_used = m.arena_bytes();
+        })));
+        results.push_back(with_arena(measure("parse_notes_only", input, bytes.size(), events, min_seconds, [&] {
+            MidiFile m(bytes, notes_only);
+            bench_sink = bench_sink + m.tempo_map().segments().size();
+            arena_used = m.arena_bytes();
+        })));
+        // what validating costs: the same parse, failing on anything malformed
+        MidiParseOptions strict = full;
+        strict.strict = true;
+        results.push_back(with_arena(measure("parse_strict", input, bytes.size(), events, min_seconds, [&] {
+            MidiFile m(bytes, strict);
+            bench_sink = bench_sink + m.tempo_map().segments().size();
+            arena_used = m.arena_bytes();
+        })));
+        // and how soon a file cut in half is turned away (strict, as lenient takes a cut that
+        // happens to fall between two chunks)
+        auto truncated = bytes.first(bytes.size() / 2);
+        results.push_back(measure("reject_truncated", input, truncated.size(), 1, min_seconds, [&] {
+            try {
+                MidiFile m(truncated, strict);
+            }
+            catch (const MidiParseError& e) {
+                bench_sink = bench_sink + static_cast<size_t>(e.code());
+            }
+        }));
+        // a policy compiled for one kind - the decoder steps over everything else
+        results.push_back(with_arena(measure("parse_tempo_only", input, bytes.size(), events, min_seconds, [&] {
+            MidiFile m(bytes, MidiParsePolicy<midi_kind(MidiEvent::EventType::Tempo)>{});
+            bench_sink = bench_sink + m.tempo_map().segments().size();
+            arena_used = m.arena_bytes();
+        })));
+
+        // what a catalog needs: open without decoding, or just the metas and counts
+        MidiParseOptions lazy = full;
+        lazy.lazy = true;
+        results.push_back(measure("open_lazy", input, bytes.size(), events, min_seconds, [&] {
+            MidiFile m(bytes, lazy);
+            bench_sink = bench_sink + m.track_count();
+        }));
+        results.push_back(measure("scan", input, bytes.size(), events, min_seconds, [&] {
+            MidiFileInfo info = MidiFile::scan(bytes);
+            bench_sink = bench_sink + info.tracks.size();
+        }));
+
+        // pairing on its own, over the already decoded events
+        std::vector<std::pmr::vector<MidiNote>> paired(tracks.size());
+        MidiNotePairer pairer;
+        results.push_back(measure("pair_notes", input, 0, note_events, min_seconds, [&] {
+            for (size_t i = 0; i < tracks.size(); ++i) {
+                paired[i].clear();
+                pairer.start_track(paired[i]);
+                uint32_t tick = 0;
+                for (const auto& e : tracks[i].events) {
+                    tick += e.delta_time;
+                    if (e.event == MidiEvent::EventType::NoteOn)
+                        pairer.note_on(e.channel, e.note, e.velocity, tick);
+                    else if (e.event == MidiEvent::EventType::NoteOff)
+                        pairer.note_off(e.channel, e.note, tick);
+                }
+                pairer.finish_track(tick, MidiDanglingNotes::Drop);
+            }
+        }));
+
+        results.push_back(measure("merge_events", input, 0, events, min_seconds, [&] {
+            uint64_t sum = 0;
+            for (const auto& e : midi.merged_events_view())
+                sum += e.time;
+            bench_sink = bench_sink + sum;
+        }));
+        results.push_back(measure("merge_notes", input, 0, notes, min_seconds, [&] {
+            uint64_t sum = 0;
+            for (const auto& n : midi.merged_notes_view())
+                sum += n.note.start_time;
+            bench_sink = bench_sink + sum;
+        }));
+
+        results.push_back(measure("index_build", input, 0, notes, min_seconds, [&] {
+            MidiNoteIndex index(midi);
+            bench_sink = bench_sink + index.notes().size();
+        }));
+
+        // a visualizer's sweep: 960 tick windows, 480 ticks apart, start to end
+        MidiNoteIndex index(midi);
+        uint32_t last = 0;
+        for (const auto& n : index.notes())
+            last = std::max(last, n.note.start_time + n.note.duration);
+        uint32_t beat = 480;
+        uint64_t queries = last / beat + 1;
+        std::vector<uint32_t> found;
+        results.push_back(measure("lookup", input, 0, queries, min_seconds, [&] {
+            uint64_t sum = 0;
+            for (uint32_t t0 = 0; t0 <= last; t0 += beat) {
+                index.query(t0, t0 + 2 * beat, found);
+                sum += found.size();
+            }
+            bench_sink = bench_sink + sum;
+        }));
+        results.push_back(measure("lookup_cursor", input, 0, queries, min_seconds, [&] {
+            uint64_t sum = 0;
+            MidiNoteCursor cursor(index);
+            for (uint32_t t0 = 0; t0 <= last; t0 += beat) {
+                cursor.advance(t0, t0 + 2 * beat);
+                sum += cursor.sounding().size();
+            }
+            bench_sink = bench_sink + sum;
+        }));
+    }
+
+    std::string synth_name(const MidiSynthOptions& o) {
+        std::ostringstream name;
+        name << "synth/tracks:" << o.num_tracks << "/events:" << o.events_per_track
+             << "/running:" << o.running_status << "/sysex_meta:" << o.sysex_meta;
+        return name.str();
+    }
+
+    void write_json_string(std::ostream& out, const std::string& s) {
+        out << '"';
+        for (char c : s) {
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if (static_cast<unsigned char>(c) < 0x20)
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+            else
+                out << c;
+        }
+        out << '"';
+    }
+}
+
+void midi_bench_suite(std::ostream& out, const MidiBenchOptions& options) {
+    std::vector<BenchResult> results;
+
+    for (const auto& path : options.files) {
+        MidiFileMapping mapping(path);
+        bench_input(path, mapping.bytes(), options, results);
+    }
+
+    if (options.synthetic) {
+        // One middle of the road file, then one knob turned at a time
+        MidiSynthOptions base;
+        std::vector<MidiSynthOptions> cases = { base };
+        auto vary = [&](auto change) {
+            MidiSynthOptions o = base;
+            change(o);
+            cases.push_back(o);
+        };
+        vary([](MidiSynthOptions& o) { o.num_tracks = 1; o.events_per_track = 80000; });
+        vary([](MidiSynthOptions& o) { o.num_tracks = 128; o.events_per_track = 625; });
+        vary([](MidiSynthOptions& o) { o.events_per_track = 500; });
+        vary([](MidiSynthOptions& o) { o.events_per_track = 50000; });
+        vary([](MidiSynthOptions& o) { o.running_status = 0.0; });
+        vary([](MidiSynthOptions& o) { o.running_status = 1.0; });
+        vary([](MidiSynthOptions& o) { o.sysex_meta = 0.0; });
+        vary([](MidiSynthOptions& o) { o.sysex_meta = 0.2; });
+
+        for (const auto& o : cases) {
+            auto bytes = midi_synthesize(o);
+            bench_input(synth_name(o), bytes, options, results);
+        }
+    }
+
+    auto flags = out.flags();
+    out << std::setprecision(6);
+    out << "{\n  \"context\": {\n    \"scan_kernel\": \"" << midi_scan_kernel() << "\",\n"
+        << "    \"hardware_threads\": " << std::thread::hardware_concurrency() << "\n  },\n"
+        << "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto& r = results[i];
+        out << "    {\"name\": ";
+        write_json_string(out, r.operation + "/" + r.input);
+        out << ", \"operation\": \"" << r.operation << "\", \"input\": ";
+        write_json_string(out, r.input);
+        out << ", \"iterations\": " << r.iterations
+            << ", \"seconds_per_iteration\": " << r.seconds
+            << ", \"bytes\": " << r.bytes
+            << ", \"items\": " << r.items
+            << ", \"bytes_per_second\": " << (r.seconds > 0.0 ? r.bytes / r.seconds : 0.0)
+            << ", \"items_per_second\": " << (r.seconds > 0.0 ? r.items / r.seconds : 0.0)
+            << ", \"allocations\": " << r.allocations
+            << ", \"peak_bytes\": " << r.peak_bytes;
+        if (r.arena_bytes)
+            out << ", \"arena_bytes\": " << r.arena_bytes;
+        out
+            << '}' << (i + 1 < results.size() ? "," : "") << '\n';
+    }
+    out << "  ]\n}\n";
+    out.flags(flags);
+}
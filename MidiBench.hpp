@@ -0,0 +1,54 @@
+#ifndef MIDIBENCH_HPP_
+#define MIDIBENCH_HPP_
+
+// Benchmark suite for the parser and everything built on it, plus the generator for the
+// synthetic files it runs on.
+//
+// Every case is timed for parse (full fidelity, notes only, lazy open and the metadata
+// scan), note pairing, both merges, building the note index and a sweep of window lookups.
+// Results come out as JSON (one object per case and operation, with events/s, bytes/s and
+// the allocations and peak heap use of one run - for a parse also what its tracks use of
+// the arena), so two runs can be diffed or fed to a regression check.
+//
+// Heap use is counted by the global operator new/delete in MidiBench.cpp, for the thread
+// that runs an operation and only while it runs. Worker threads are not counted, so every
+// operation is measured on a single thread.
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Shape of a synthetic midi file. The same options (seed included) always give the same
+// bytes, on any platform.
+struct MidiSynthOptions {
+    uint32_t    seed = 1;
+    uint16_t    num_tracks = 16;
+    uint32_t    events_per_track = 5000;
+    double      running_status = 0.7;   // share of channel messages that leave out a repeated status byte
+    double      sysex_meta = 0.02;      // share of events that are sysex or text metas
+    uint16_t    ppqn = 480;
+};
+
+std::vector<std::byte> midi_synthesize(const MidiSynthOptions& options);
+
+// Counts the calling thread's heap allocations from start to stop: how many, and the most
+// bytes held at once beyond what was held at the start
+struct MidiAllocStats {
+    uint64_t    allocations = 0;
+    uint64_t    peak_bytes = 0;
+};
+void midi_alloc_count_start();
+MidiAllocStats midi_alloc_count_stop();
+
+struct MidiBenchOptions {
+    std::vector<std::string>    files = { "organ.mid" };    // real world cases, next to the synthetic ones
+    bool                        synthetic = true;
+    double                      min_seconds = 0.05;         // per timing round, three rounds, the best counts
+};
+
+// Runs every case and writes the JSON report to out
+void midi_bench_suite(std::ostream& out, const MidiBenchOptions& options = {});
+
+#endif // ! MIDIBENCH_HPP_
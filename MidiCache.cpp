@@ -0,0 +1,381 @@
+
+#include "MidiCache.hpp"
+#include <bit>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+
+// Everything in the file is stored exactly as it sits in memory, so a cache only fits
+// the struct layout (and byte order) of the build that wrote it
+namespace {
+    constexpr char magic[8] = { 'M', 'I', 'D', 'I', 'C', 'A', 'C', 'H' };
+    constexpr size_t alignment = 8;
+
+    constexpr uint32_t layout_fingerprint() {
+        return uint32_t(sizeof(MidiEvent)) | (uint32_t(sizeof(MidiNote)) << 8)
+            | (uint32_t(sizeof(TempoMap::Segment)) << 16)
+            | (uint32_t(std::endian::native == std::endian::little ? 1 : 2) << 24);
+    }
+
+    // A run of bytes in the cache file
+    struct Section {
+        uint64_t    offset = 0;
+        uint64_t    size = 0;
+    };
+
+    // Records go in a field at a time over bytes that start out zero, so their padding is
+    // written as zeros too and the same input always makes the same file
+    void store(std::byte* at, const MidiEvent& e) {
+        std::memcpy(at + offsetof(MidiEvent, event), &e.event, sizeof(e.event));
+        std::memcpy(at + offsetof(MidiEvent, delta_time), &e.delta_time, sizeof(e.delta_time));
+        std::memcpy(at + offsetof(MidiEvent, note), &e.note, sizeof(e.note));
+        std::memcpy(at + offsetof(MidiEvent, velocity), &e.velocity, sizeof(e.velocity));
+        std::memcpy(at + offsetof(MidiEvent, channel), &e.channel, sizeof(e.channel));
+        std::memcpy(at + offsetof(MidiEvent, meta), &e.meta, sizeof(e.meta));
+        std::memcpy(at + offsetof(MidiEvent, payload), &e.payload, sizeof(e.payload));
+    }
+    void store(std::byte* at, const MidiNote& n) {
+        std::memcpy(at + offsetof(MidiNote, note), &n.note, sizeof(n.note));
+        std::memcpy(at + offsetof(MidiNote, velocity), &n.velocity, sizeof(n.velocity));
+        std::memcpy(at + offsetof(MidiNote, channel), &n.channel, sizeof(n.channel));
+        std::memcpy(at + offsetof(MidiNote, start_time), &n.start_time, sizeof(n.start_time));
+        std::memcpy(at + offsetof(MidiNote, duration), &n.duration, sizeof(n.duration));
+    }
+    void store(std::byte* at, const TempoMap::Segment& s) {
+        std::memcpy(at + offsetof(TempoMap::Segment, tick), &s.tick, sizeof(s.tick));
+        std::memcpy(at + offsetof(TempoMap::Segment, seconds), &s.seconds, sizeof(s.seconds));
+        std::memcpy(at + offsetof(TempoMap::Segment, seconds_per_tick), &s.seconds_per_tick, sizeof(s.seconds_per_tick));
+    }
+}
+
+struct MidiCache::Header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    layout;
+    uint64_t    source_hash;
+    uint64_t    file_size;
+    Section     tempo;              // TempoMap::Segment[]
+    uint32_t    num_tracks;         // entries in the track table right after the header
+    uint32_t    file_id;
+    uint16_t    declared_tracks;    // number of tracks the MThd header claimed
+    uint16_t    ppqn;
+    uint16_t    fps;
+    uint16_t    sfps;
+    uint8_t     smpte;
+    uint8_t     reserved[7];
+};
+
+struct MidiCache::Track {
+    Section     events;             // MidiEvent[]
+    Section     notes;              // MidiNote[]
+    Section     payloads;
+    Section     name;
+    Section     instrument;
+    Section     copyright;
+    uint8_t     port;
+    uint8_t     reserved[7];
+};
+
+
+MidiCache::MidiCache(MidiFileMapping map)
+    : mapping(std::move(map))
+{
+    auto bytes = mapping.bytes();
+    if (bytes.size() < sizeof(Header))
+        throw MidiParseError("Not a midi cache file");
+
+    const Header& h = header();
+    if (std::memcmp(h.magic, magic, sizeof(magic)) != 0)
+        throw MidiParseError("Not a midi cache file");
+    if (h.version != version || h.layout != layout_fingerprint())
+        throw MidiParseError("Midi cache file from another version");
+    if (h.file_size != bytes.size())
+        throw MidiParseError("Midi cache file is truncated");
+    if (h.num_tracks > (bytes.size() - sizeof(Header)) / sizeof(Track))
+        throw MidiParseError("Midi cache track table runs past the end of the file");
+
+    // The section table first, then everything in a section that points somewhere else
+    auto check = [&bytes](const Section& s, size_t element_size) {
+        if (s.offset % alignment || s.size % element_size || s.offset > bytes.size() || s.size > bytes.size() - s.offset)
+            throw MidiParseError("Midi cache section out of bounds");
+    };
+    check(h.tempo, sizeof(TempoMap::Segment));
+    if (h.tempo.size == 0)
+        throw MidiParseError("Midi cache has no tempo map");
+    // TempoMap looks ticks up in its segments by binary search, from one at tick 0
+    auto segments = tempo_segments();
+    if (segments[0].tick != 0)
+        throw MidiParseError("Midi cache tempo map does not start at tick 0");
+    for (size_t i = 1; i < segments.size(); ++i) {
+        if (segments[i].tick <= segments[i - 1].tick)
+            throw MidiParseError("Midi cache tempo map is out of order");
+    }
+    for (size_t i = 0; i < h.num_tracks; ++i) {
+        const Track& t = track_entry(i);
+        check(t.events, sizeof(MidiEvent));
+        check(t.notes, sizeof(MidiNote));
+        check(t.payloads, 1);
+        check(t.name, 1);
+        check(t.instrument, 1);
+        check(t.copyright, 1);
+
+        // every sysex/meta payload has to be inside the payloads section, length and all
+        MidiCachedTrack cached = track(i);
+        for (const MidiEvent& e : cached.events) {
+            if (e.event != MidiEvent::EventType::SysEx && e.event != MidiEvent::EventType::Meta)
+                continue;
+            uint32_t length;
+            if (e.payload > cached.payloads.size() || cached.payloads.size() - e.payload < sizeof(length))
+                throw MidiParseError("Midi cache payload out of bounds");
+            std::memcpy(&length, cached.payloads.data() + e.payload, sizeof(length));
+            if (length > cached.payloads.size() - e.payload - sizeof(length))
+                throw MidiParseError("Midi cache payload out of bounds");
+        }
+    }
+}
+
+std::optional<MidiCache> MidiCache::open(const std::string& path, uint64_t source_hash) {
+    try {
+        MidiCache cache{ MidiFileMapping(path) };
+        if (cache.source_hash() == source_hash)
+            return cache;
+    }
+    catch (const std::system_error&) {
+    }
+    catch (const MidiParseError&) {
+    }
+    return std::nullopt;
+}
+
+const MidiCache::Header& MidiCache::header() const {
+    return *reinterpret_cast<const Header*>(mapping.bytes().data());
+}
+
+const MidiCache::Track& MidiCache::track_entry(size_t i) const {
+    return reinterpret_cast<const Track*>(mapping.bytes().data() + sizeof(Header))[i];
+}
+
+uint64_t MidiCache::source_hash() const {
+    return header().source_hash;
+}
+
+size_t MidiCache::num_tracks() const {
+    return header().num_tracks;
+}
+
+MidiCachedTrack MidiCache::track(size_t i) const {
+    const std::byte* base = mapping.bytes().data();
+    const Track& t = track_entry(i);
+
+    auto string = [base](const Section& s) {
+        return std::string_view(reinterpret_cast<const char*>(base + s.offset), s.size);
+    };
+    auto bytes = [base](const Section& s) {
+        return std::span<const std::byte>(base + s.offset, s.size);
+    };
+
+    MidiCachedTrack track;
+    track.name = string(t.name);
+    track.instrument = string(t.instrument);
+    track.copyright = string(t.copyright);
+    track.events = { reinterpret_cast<const MidiEvent*>(base + t.events.offset), t.events.size / sizeof(MidiEvent) };
+    track.notes = { reinterpret_cast<const MidiNote*>(base + t.notes.offset), t.notes.size / sizeof(MidiNote) };
+    track.payloads = bytes(t.payloads);
+    track.port = t.port;
+    return track;
+}
+
+std::span<const TempoMap::Segment> MidiCache::tempo_segments() const {
+    const Section& s = header().tempo;
+    return { reinterpret_cast<const TempoMap::Segment*>(mapping.bytes().data() + s.offset), s.size / sizeof(TempoMap::Segment) };
+}
+
+TempoMap MidiCache::tempo_map() const {
+    return TempoMap::from_segments(tempo_segments());
+}
+
+MidiFile MidiCache::to_midi_file(MidiEventStorage storage) && {
+    const Header& h = header();
+
+    MidiFile midi;
+    midi.file_id = h.file_id;
+    midi.num_tracks = h.declared_tracks;
+    midi.SMPTE = h.smpte != 0;
+    midi.fps = h.fps;
+    midi.sfps = h.sfps;
+    midi.ppqn = h.ppqn;
+    midi.tempo = tempo_map();
+
+    midi.make_tracks(num_tracks(), mapping.bytes().size());
+    for (size_t i = 0; i < midi.tracks.size(); ++i) {
+        MidiCachedTrack cached = track(i);
+        MidiTrack& t = midi.tracks[i];
+        t.name = cached.name;
+        t.instrument = cached.instrument;
+        t.copyright = cached.copyright;
+        if (storage == MidiEventStorage::Columns) {
+            uint32_t tick = 0;
+            for (const MidiEvent& e : cached.events)
+                t.columns.push_back(tick += e.delta_time, e);
+        }
+        else
+            t.events.assign(cached.events.begin(), cached.events.end());
+        t.notes.assign(cached.notes.begin(), cached.notes.end());
+        t.payloads.assign(cached.payloads.begin(), cached.payloads.end());
+        t.port = cached.port;
+    }
+
+    // the strings point into the mapping, so it moves in with them
+    midi.mapping = std::move(mapping);
+    return midi;
+}
+
+void MidiCache::write(const MidiFile& midi, uint64_t source_hash, const std::string& path) {
+
+    midi.decode_all(); // a lazy file has to be all there before it can be cached
+
+    // header and track table first, the sections follow in track order
+    std::vector<std::byte> out(sizeof(Header) + midi.tracks.size() * sizeof(Track));
+
+    auto append = [&out](const void* data, size_t size) {
+        Section s{ (out.size() + alignment - 1) / alignment * alignment, size };
+        out.resize(s.offset + size);
+        if (size)
+            std::memcpy(out.data() + s.offset, data, size);
+        return s;
+    };
+    auto append_records = [&out](const auto& records) {
+        using Record = std::remove_cvref_t<decltype(records[0])>;
+        Section s{ (out.size() + alignment - 1) / alignment * alignment, records.size() * sizeof(Record) };
+        out.resize(s.offset + s.size);
+        for (size_t i = 0; i < records.size(); ++i)
+            store(out.data() + s.offset + i * sizeof(Record), records[i]);
+        return s;
+    };
+
+    Header h{};
+    std::memcpy(h.magic, magic, sizeof(magic));
+    h.version = version;
+    h.layout = layout_fingerprint();
+    h.source_hash = source_hash;
+    h.num_tracks = static_cast<uint32_t>(midi.tracks.size());
+    h.file_id = midi.file_id;
+    h.declared_tracks = midi.num_tracks;
+    h.ppqn = midi.ppqn;
+    h.fps = midi.fps;
+    h.sfps = midi.sfps;
+    h.smpte = midi.SMPTE ? 1 : 0;
+
+    const auto& segments = midi.tempo.segments();
+    h.tempo = append_records(segments);
+
+    std::vector<MidiEvent> scratch; // column storage is written out as MidiEvents
+    for (size_t i = 0; i < midi.tracks.size(); ++i) {
+        const MidiTrack& src = midi.tracks[i];
+        Track t{};
+
+        if (src.columns.empty())
+            t.events = append_records(src.events);
+        else {
+            scratch.reserve(src.columns.size()); // assign can't size from input iterators
+            scratch.assign(src.columns.begin(), src.columns.end());
+            t.events = append_records(scratch);
+        }
+        t.notes = append_records(src.notes);
+        t.payloads = append(src.payloads.data(), src.payloads.size());
+        t.name = append(src.name.data(), src.name.size());
+        t.instrument = append(src.instrument.data(), src.instrument.size());
+        t.copyright = append(src.copyright.data(), src.copyright.size());
+        t.port = src.port;
+
+        std::memcpy(out.data() + sizeof(Header) + i * sizeof(Track), &t, sizeof(t));
+    }
+
+    h.file_size = out.size();
+    std::memcpy(out.data(), &h, sizeof(h));
+
+    // Other jobs may be reading the same cache - they get the old file or the whole new one
+    // - and the temporary file is ours alone, whichever process or thread writes next to us
+    std::random_device random;
+    char suffix[24];
+    std::snprintf(suffix, sizeof(suffix), ".tmp%08x%08x", random(), random());
+    std::string tmp = path + suffix;
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(out.size()));
+        if (!file)
+            throw std::system_error(std::make_error_code(std::errc::io_error), "Could not write " + tmp);
+    }
+    std::error_code err;
+    std::filesystem::rename(tmp, path, err);
+    if (err) {
+        std::filesystem::remove(tmp, err);
+        throw std::system_error(err, "Could not write " + path);
+    }
+}
+
+
+uint64_t midi_content_hash(std::span<const std::byte> bytes) {
+    // 8 bytes at a time through a multiply and rotate, murmur3's finalizer at the end.
+    // Not cryptographic - it only has to tell files apart.
+    constexpr uint64_t k1 = 0x9E3779B97F4A7C15ull;
+    constexpr uint64_t k2 = 0xC2B2AE3D27D4EB4Full;
+
+    const std::byte* p = bytes.data();
+    size_t n = bytes.size();
+    uint64_t h = k1 ^ n;
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, p + i, sizeof(w));
+        h = std::rotl(h ^ (w * k2), 31) * k1;
+    }
+    uint64_t tail = 0;
+    if (n > i) // p is null for no bytes at all
+        std::memcpy(&tail, p + i, n - i);
+    h = std::rotl(h ^ (tail * k2), 31) * k1;
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+std::string midi_cache_path(const std::string& dir, uint64_t source_hash) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.midicache", static_cast<unsigned long long>(source_hash));
+    return (std::filesystem::path(dir) / name).string();
+}
+
+MidiFile midi_load_cached(const std::string& path, const std::string& cache_dir, const MidiParseOptions& options) {
+    MidiFileMapping source(path);
+
+    // The options that change what comes out of a parse are part of the key
+    uint64_t key = midi_content_hash(source.bytes());
+    // (strict too - a file cached by a lenient parse was never validated - and the storage,
+    // which the cache can rebuild either way but a fresh parse of each would not share)
+    key ^= (uint64_t(options.full_fidelity) << 1 | uint64_t(options.dangling_notes) << 2 | uint64_t(options.strict) << 8
+            | uint64_t(options.storage) << 9) * 0x9E3779B97F4A7C15ull;
+
+    std::string cache_path = midi_cache_path(cache_dir, key);
+    if (auto cache = MidiCache::open(cache_path, key))
+        return std::move(*cache).to_midi_file(options.storage);
+
+    MidiFile midi(std::move(source), options);
+    try {
+        MidiCache::write(midi, key, cache_path);
+    }
+    catch (const std::system_error&) {
+    }
+    return midi;
+}
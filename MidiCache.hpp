@@ -0,0 +1,97 @@
+#ifndef MIDICACHE_HPP_
+#define MIDICACHE_HPP_
+
+// Pre-parsed midi files on disk. A cache file holds the decoded events, notes, payloads
+// and track names of every track plus the tempo map, each section 8 byte aligned so it
+// can be used right where it is mapped. Opening one checks the header, the section
+// table, that the tempo map starts at tick 0 and goes up, and that every payload an
+// event points to is inside its track's payloads - no decoding and no allocation, just
+// one pass over the events.
+//
+// A cache is keyed by midi_content_hash() of the source file and is only valid for the
+// build that wrote it (the header records the format version and the in-memory layout
+// of the structs it stores).
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "MidiFile.hpp"
+#include "MidiFileMapping.hpp"
+#include "TempoMap.hpp"
+
+// A track straight out of the cache - the same data a parsed MidiTrack holds, as views
+// into the mapping
+struct MidiCachedTrack {
+    std::string_view            name;
+    std::string_view            instrument;
+    std::string_view            copyright;
+    std::span<const MidiEvent>  events;
+    std::span<const MidiNote>   notes;      // in start order
+    std::span<const std::byte>  payloads;
+    uint8_t                     port = 0;
+
+    std::span<const std::byte> payload(const MidiEvent& e) const {
+        if (e.event != MidiEvent::EventType::SysEx && e.event != MidiEvent::EventType::Meta)
+            return {};
+        uint32_t length;
+        std::memcpy(&length, payloads.data() + e.payload, sizeof(length));
+        return { payloads.data() + e.payload + sizeof(length), length };
+    }
+    std::string_view text(const MidiEvent& e) const {
+        auto p = payload(e);
+        return { reinterpret_cast<const char*>(p.data()), p.size() };
+    }
+};
+
+class MidiCache {
+public:
+    static constexpr uint32_t version = 2; // 2: notes only parses no longer keep Other events
+
+    // Throws MidiParseError if mapping is not a cache file this build can read
+    explicit MidiCache(MidiFileMapping mapping);
+
+    // The cache at path if it exists, is readable and was made from a source with this
+    // hash - otherwise nothing
+    static std::optional<MidiCache> open(const std::string& path, uint64_t source_hash);
+
+    // Writes midi to path (through a temporary file and a rename, so a reader never sees
+    // half a cache). Throws std::system_error if the file can't be written.
+    static void write(const MidiFile& midi, uint64_t source_hash, const std::string& path);
+
+    uint64_t source_hash() const;
+    size_t num_tracks() const;
+    MidiCachedTrack track(size_t i) const;
+
+    std::span<const TempoMap::Segment> tempo_segments() const;
+    TempoMap tempo_map() const;
+
+    // A regular MidiFile with the same tracks as a fresh parse with this storage. Events,
+    // notes and payloads are copied out of the mapping (still no decoding), the strings
+    // keep pointing into it.
+    MidiFile to_midi_file(MidiEventStorage storage = MidiEventStorage::Events) &&;
+
+private:
+    struct Header;
+    struct Track;
+
+    const Header& header() const;
+    const Track& track_entry(size_t i) const;
+
+    MidiFileMapping mapping;
+};
+
+// 64 bit hash of a whole source file - the cache key
+uint64_t midi_content_hash(std::span<const std::byte> bytes);
+
+// <dir>/<16 hex digit hash>.midicache
+std::string midi_cache_path(const std::string& dir, uint64_t source_hash);
+
+// Parses path, or loads it from cache_dir if it was parsed before. A fresh parse is
+// written to the cache for next time (a failure to write it is not an error).
+MidiFile midi_load_cached(const std::string& path, const std::string& cache_dir, const MidiParseOptions& options = {});
+
+#endif // ! MIDICACHE_HPP_
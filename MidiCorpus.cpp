@@ -0,0 +1,182 @@
+
+#include "MidiCorpus.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <system_error>
+
+
+namespace {
+
+    // One per worker. The owner takes from the front, thieves from the back, so they
+    // only ever meet on the last item.
+    struct WorkQueue {
+        std::mutex          lock;
+        std::deque<size_t>  items;
+
+        bool pop_front(size_t& item) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (items.empty())
+                return false;
+            item = items.front();
+            items.pop_front();
+            return true;
+        }
+        bool steal_back(size_t& item) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (items.empty())
+                return false;
+            item = items.back();
+            items.pop_back();
+            return true;
+        }
+    };
+
+    // The whole file in one read. Results own their bytes - a mapping each would keep one
+    // mmap alive per file for as long as the corpus, and a big batch runs into the limit
+    // on those (vm.max_map_count) long before it runs out of memory.
+    std::vector<std::byte> read_file(const std::string& path) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+            throw std::system_error(std::make_error_code(std::errc::io_error), "Could not open " + path);
+        auto size = file.tellg();
+        if (size < 0)
+            throw std::system_error(std::make_error_code(std::errc::io_error), "Could not read " + path);
+        std::vector<std::byte> bytes(static_cast<size_t>(size));
+        file.seekg(0);
+        if (!file.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(bytes.size())))
+            throw std::system_error(std::make_error_code(std::errc::io_error), "Could not read " + path);
+        return bytes;
+    }
+
+    bool is_midi_extension(const std::filesystem::path& p) {
+        std::string ext = p.extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return ext == ".mid" || ext == ".midi" || ext == ".smf";
+    }
+}
+
+
+MidiCorpus::MidiCorpus(std::vector<std::string> paths)
+    : file_paths(std::move(paths))
+{
+}
+
+MidiCorpus MidiCorpus::from_directory(const std::string& dir, bool recursive) {
+    namespace fs = std::filesystem;
+    std::vector<std::string> found;
+
+    auto consider = [&found](const fs::directory_entry& entry) {
+        std::error_code ec;
+        if (entry.is_regular_file(ec) && is_midi_extension(entry.path()))
+            found.push_back(entry.path().string());
+    };
+    if (recursive) {
+        for (const auto& entry : fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied))
+            consider(entry);
+    }
+    else {
+        for (const auto& entry : fs::directory_iterator(dir, fs::directory_options::skip_permission_denied))
+            consider(entry);
+    }
+    std::sort(found.begin(), found.end());
+    return MidiCorpus(std::move(found));
+}
+
+const MidiCorpusStats& MidiCorpus::parse(unsigned num_threads, bool strict) {
+
+    auto started = std::chrono::steady_clock::now();
+
+    file_results.clear();
+    file_results.resize(file_paths.size());
+    batch_stats = MidiCorpusStats();
+
+    // Each file is parsed on a single thread - the parallelism is across files
+    MidiParseOptions options;
+    options.num_threads = 1;
+    options.strict = strict;
+
+    auto parse_one = [&](size_t idx) {
+        MidiCorpusResult& result = file_results[idx];
+        result.path = file_paths[idx];
+        try {
+            std::vector<std::byte> bytes = read_file(result.path);
+            result.bytes = bytes.size();
+            // lenient or not, a .mid that isn't one is a failure - not an empty file
+            if (!MidiFile::is_midi(bytes))
+                throw MidiParseError(MidiErrc::NotMidi, "Not a midi file (no MThd)", 0);
+            result.midi.emplace(std::move(bytes), options);
+        }
+        catch (const MidiParseError& e) {
+            result.midi.reset();
+            result.error = e.what();
+            result.error_code = e.code();
+        }
+        catch (const std::exception& e) {
+            result.midi.reset();
+            result.error = e.what();
+        }
+    };
+
+    size_t workers = std::max<size_t>(1, std::min<size_t>(num_threads, file_paths.size()));
+
+    // Deal the files out biggest first and round robin, so every worker starts with a
+    // similar load. Stealing evens out whatever the sizes didn't predict.
+    std::vector<uint64_t> sizes(file_paths.size(), 0);
+    for (size_t i = 0; i < file_paths.size(); ++i) {
+        std::error_code ec;
+        auto sz = std::filesystem::file_size(file_paths[i], ec);
+        sizes[i] = ec ? 0 : sz;
+    }
+    std::vector<size_t> order(file_paths.size());
+    std::iota(order.begin(), order.end(), size_t{ 0 });
+    std::stable_sort(order.begin(), order.end(), [&sizes](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    for (size_t w = 0; w < workers; ++w)
+        queues.push_back(std::make_unique<WorkQueue>());
+    for (size_t i = 0; i < order.size(); ++i)
+        queues[i % workers]->items.push_back(order[i]);
+
+    auto worker = [&](size_t w) {
+        size_t idx;
+        for (;;) {
+            if (queues[w]->pop_front(idx)) {
+                parse_one(idx);
+                continue;
+            }
+            // Own queue is dry - go looking in the others. Nothing new is ever queued,
+            // so once a full round finds nothing we are done.
+            bool stole = false;
+            for (size_t v = 1; v < workers && !stole; ++v)
+                stole = queues[(w + v) % workers]->steal_back(idx);
+            if (!stole)
+                return;
+            parse_one(idx);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(workers - 1);
+    for (size_t w = 1; w < workers; ++w)
+        pool.emplace_back(worker, w);
+    worker(0);
+    for (auto& t : pool)
+        t.join();
+
+    for (const auto& r : file_results) {
+        ++batch_stats.files;
+        batch_stats.bytes += r.bytes;
+        if (!r.midi)
+            ++batch_stats.failed;
+    }
+    batch_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return batch_stats;
+}
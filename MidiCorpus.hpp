@@ -0,0 +1,59 @@
+#ifndef MIDICORPUS_HPP_
+#define MIDICORPUS_HPP_
+
+// Batch parsing of many midi files. Files are spread over a set of worker threads, each
+// with its own queue - a worker that runs dry steals from the others, so a few multi MB
+// files don't leave the rest of the cores idle while one thread chews through them.
+//
+// One bad file never stops the batch, its result just carries the error instead. Each
+// result owns a copy of its file's bytes, no mapping is kept open.
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MidiFile.hpp"
+
+struct MidiCorpusResult {
+    std::string             path;
+    std::optional<MidiFile> midi;       // empty if the file could not be parsed
+    std::string             error;      // why it could not
+    std::optional<MidiErrc> error_code; // what was wrong with the data, when that was why
+    uint64_t                bytes = 0;
+};
+
+struct MidiCorpusStats {
+    size_t      files = 0;
+    size_t      failed = 0;
+    uint64_t    bytes = 0;
+    double      seconds = 0.0;
+
+    double files_per_second() const { return seconds > 0.0 ? files / seconds : 0.0; }
+    double mb_per_second() const { return seconds > 0.0 ? bytes / 1e6 / seconds : 0.0; }
+};
+
+class MidiCorpus {
+public:
+    explicit MidiCorpus(std::vector<std::string> paths);
+
+    // Every .mid/.midi/.smf file below dir, sorted so the results are in a stable order
+    static MidiCorpus from_directory(const std::string& dir, bool recursive = true);
+
+    // Parses every file. Results come back in the same order as paths(). strict fails
+    // every malformed file rather than taking what can be read of it.
+    const MidiCorpusStats& parse(unsigned num_threads = std::thread::hardware_concurrency(), bool strict = false);
+
+    const std::vector<std::string>&         paths() const { return file_paths; }
+    const std::vector<MidiCorpusResult>&    results() const { return file_results; }
+    std::vector<MidiCorpusResult>&          results() { return file_results; }
+    const MidiCorpusStats&                  stats() const { return batch_stats; }
+
+private:
+    std::vector<std::string>        file_paths;
+    std::vector<MidiCorpusResult>   file_results;
+    MidiCorpusStats                 batch_stats;
+};
+
+#endif // ! MIDICORPUS_HPP_
@@ -0,0 +1,99 @@
+
+#include "MidiDiagnostics.hpp"
+#include "MidiFile.hpp"
+#include <iomanip>
+#include <iostream>
+
+
+const char* midi_phase_name(MidiPhase phase) {
+    switch (phase) {
+    case MidiPhase::Header:         return "header";
+    case MidiPhase::Decode:         return "decode";
+    case MidiPhase::TempoMap:       return "tempo_map";
+    case MidiPhase::MergeNotes:     return "merge_notes";
+    case MidiPhase::MergeEvents:    return "merge_events";
+    default:                        return "?";
+    }
+}
+
+
+void MidiDiagnosticsRecorder::header(uint16_t fmt, uint16_t tracks_in_header, uint16_t div) {
+    std::lock_guard<std::mutex> guard(lock);
+    format = fmt;
+    num_tracks = tracks_in_header;
+    division = div;
+    tracks.clear();
+}
+
+void MidiDiagnosticsRecorder::track(size_t index, const MidiTrack&, const MidiTrackStats& stats) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (tracks.size() <= index)
+        tracks.resize(index + 1);
+    tracks[index] = stats;
+}
+
+void MidiDiagnosticsRecorder::phase(MidiPhase phase, double seconds) {
+    std::lock_guard<std::mutex> guard(lock);
+    phase_seconds[static_cast<size_t>(phase)] += seconds;
+}
+
+void MidiDiagnosticsRecorder::warning(std::string_view message) {
+    std::lock_guard<std::mutex> guard(lock);
+    warnings.emplace_back(message);
+}
+
+MidiTrackStats MidiDiagnosticsRecorder::totals() const {
+    MidiTrackStats sum;
+    for (const auto& t : tracks) {
+        sum.chunk_bytes += t.chunk_bytes;
+        sum.bytes += t.bytes;
+        sum.events += t.events;
+        for (size_t i = 0; i < sum.opcodes.size(); ++i)
+            sum.opcodes[i] += t.opcodes[i];
+        sum.running_status += t.running_status;
+        sum.seconds += t.seconds;
+    }
+    return sum;
+}
+
+void MidiDiagnosticsRecorder::print(std::ostream& os) const {
+    auto flgs = os.flags();
+    MidiTrackStats sum = totals();
+    os << tracks.size() << " tracks, " << sum.events << " events, " << sum.bytes << " bytes, "
+       << sum.running_status << " running status\n";
+    os << "opcodes:";
+    for (size_t i = 0; i < sum.opcodes.size(); ++i)
+        if (sum.opcodes[i])
+            os << ' ' << std::hex << std::uppercase << i << "x: " << std::dec << sum.opcodes[i];
+    os << '\n' << std::fixed << std::setprecision(1);
+    for (size_t p = 0; p < phase_seconds.size(); ++p)
+        os << midi_phase_name(static_cast<MidiPhase>(p)) << ": " << phase_seconds[p] * 1e6 << " us\n";
+    for (const auto& w : warnings)
+        os << "warning: " << w << '\n';
+    os.flags(flgs);
+}
+
+
+void MidiConsoleDiagnostics::header(uint16_t, uint16_t num_tracks, uint16_t division) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto flgs = std::cout.flags();
+    std::cout << "0x" << std::hex << std::setw(8) << std::setfill('0') << num_tracks << '\n';
+    std::cout.flags(flgs);
+    if (division & 0x8000) // SMPTE, the high byte holds -fps
+        std::cout << "fps: " << -static_cast<int8_t>(division >> 8);
+}
+
+void MidiConsoleDiagnostics::track(size_t index, const MidiTrack& track, const MidiTrackStats& stats) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::cout << "TRACK --- " << index << " --- (" << stats.chunk_bytes << " bytes long)\n";
+    if (!track.copyright.empty())
+        std::cout << "COPYRIGHT: " << track.copyright << '\n';
+    if (!track.instrument.empty())
+        std::cout << "INSTRUMENT NAME: " << track.instrument << '\n';
+    std::cout << '\n';
+}
+
+void MidiConsoleDiagnostics::warning(std::string_view message) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::cerr << "WARNING: " << message << '\n';
+}
@@ -0,0 +1,97 @@
+#ifndef MIDIDIAGNOSTICS_HPP_
+#define MIDIDIAGNOSTICS_HPP_
+
+// What the parser can tell about its work: phase timings, per track message counts and
+// bytes, and warnings about odd data it got past. Set a MidiDiagnostics in
+// MidiParseOptions to get them - without one nothing is measured or printed. The track
+// decoder is compiled twice, and the copy without the counters is the one that runs by
+// default.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct MidiTrack;
+
+enum class MidiPhase : uint8_t {
+    Header,         // MThd and the chunk index
+    Decode,         // all tracks - notes are paired while decoding
+    TempoMap,
+    MergeNotes,     // MidiFile::merged_notes(), when first asked for
+    MergeEvents     // MidiFile::merged_events(), when first asked for
+};
+constexpr size_t midi_num_phases = 5;
+
+const char* midi_phase_name(MidiPhase phase);
+
+struct MidiTrackStats {
+    uint64_t                    chunk_bytes = 0;    // length of the MTrk chunk
+    uint64_t                    bytes = 0;          // consumed - less if the end of track came early
+    uint64_t                    events = 0;
+    std::array<uint64_t, 16>    opcodes{};          // messages by the high nibble of their status byte:
+                                                    // 8-E channel messages, F sysex and meta,
+                                                    // 0 data where a status byte was due
+    uint64_t                    running_status = 0; // messages that reused the previous status byte
+    double                      seconds = 0.0;      // decoding and pairing this track
+};
+
+// track(), phase() and warning() may be called from several threads at once, so an
+// implementation has to be safe for that: a lazily opened file reports from whichever
+// threads ask for tracks, the tempo map or the merges, and warnings come from the decode
+// threads when MidiParseOptions::num_threads > 1.
+class MidiDiagnostics {
+public:
+    virtual ~MidiDiagnostics() = default;
+
+    // The MThd fields
+    virtual void header(uint16_t /*format*/, uint16_t /*num_tracks*/, uint16_t /*division*/) {}
+    // Once per track, in track order, after all of them are decoded. For a lazily opened
+    // file instead as each track gets decoded (in no particular order), and Decode is
+    // never reported.
+    virtual void track(size_t /*index*/, const MidiTrack& /*track*/, const MidiTrackStats& /*stats*/) {}
+    virtual void phase(MidiPhase /*phase*/, double /*seconds*/) {}
+    // Something odd the parser got past
+    virtual void warning(std::string_view /*message*/) {}
+};
+
+// Keeps everything for a look afterwards - read the members once the parse (or the last
+// lazy decode) is done
+class MidiDiagnosticsRecorder : public MidiDiagnostics {
+public:
+    void header(uint16_t format, uint16_t num_tracks, uint16_t division) override;
+    void track(size_t index, const MidiTrack& track, const MidiTrackStats& stats) override;
+    void phase(MidiPhase phase, double seconds) override;
+    void warning(std::string_view message) override;
+
+    uint16_t                                format = 0;
+    uint16_t                                num_tracks = 0;
+    uint16_t                                division = 0;
+    std::vector<MidiTrackStats>             tracks;
+    std::array<double, midi_num_phases>     phase_seconds{};    // summed over every file parsed
+    std::vector<std::string>                warnings;
+
+    MidiTrackStats totals() const;          // all tracks added up (seconds too)
+    void print(std::ostream& os) const;
+
+private:
+    std::mutex                              lock;
+};
+
+// The parser's old console chatter: number of tracks, track headers, copyright and
+// instrument names to std::cout, warnings to std::cerr
+class MidiConsoleDiagnostics : public MidiDiagnostics {
+public:
+    void header(uint16_t format, uint16_t num_tracks, uint16_t division) override;
+    void track(size_t index, const MidiTrack& track, const MidiTrackStats& stats) override;
+    void warning(std::string_view message) override;
+
+private:
+    std::mutex  lock;
+};
+
+#endif // ! MIDIDIAGNOSTICS_HPP_
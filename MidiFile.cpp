@@ -10,14 +10,63 @@
 // as a very simple playback sequencer. I will let that be a separate project.
 
 #include "MidiFile.hpp"
+#include "MidiBench.hpp"
+#include "MidiDiagnostics.hpp"
+#include "MidiNotePairer.hpp"
+#include "MidiPlayer.hpp"
+#include "MidiScan.hpp"
+#include "MidiTrackDecoder.hpp"
 #include <iostream>
-#include <map>
 #include <iomanip>
 #include <ios>
+#include <cstring>
+#include <algorithm>
+#include <bit>
+#include <atomic>
+#include <exception>
+#include <numeric>
+#include <thread>
+#include <chrono>
+
+
+
+#ifndef MIDI_FUZZ   // the fuzz target brings its own entry point, see MidiFuzz.cpp
+int main(int argc, char* argv[]) {
+
+    // --bench [midi file] runs the bench suite on that one file (organ.mid if none) only
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        MidiBenchOptions bench_options;
+        bench_options.files = { argc > 2 ? argv[2] : "organ.mid" };
+        bench_options.synthetic = false;
+        midi_bench_suite(std::cout, bench_options);
+        return 0;
+    }
 
+    // --bench-json [file] runs the whole suite (organ.mid and synthetic files) with a JSON report
+    if (argc > 1 && std::string(argv[1]) == "--bench-json") {
+        if (argc > 2) {
+            std::ofstream report(argv[2]);
+            midi_bench_suite(report);
+        }
+        else
+            midi_bench_suite(std::cout);
+        return 0;
+    }
 
-
-int main() {
+    // --play <logfile> [speed] plays organ.mid into a time logged file
+    if (argc > 2 && std::string(argv[1]) == "--play") {
+        MidiFile midi(MidiFileMapping("organ.mid"));
+
+        MidiPlayerOptions play_options;
+        if (argc > 3)
+            play_options.speed = std::stod(argv[3]);
+        MidiPlayer player(midi, MidiLogSink(argv[2]), play_options);
+        player.start();
+        player.wait();
+        player.jitter().print(std::cout, "dispatch jitter");
+        player.latency().print(std::cout, "sink latency");
+        return 0;
+    }
 
     std::ifstream midistream("organ.mid", std::ios::binary);
 
@@ -26,7 +75,11 @@ int main() {
         // Midi file will parse out all note-on and note-off events for each track
         // It will also create a "view" for each track with note_on, and duration
         // meant for visualization (not implemented - see Javidx9's video)
-        MidiFile midi(midistream);
+        // The parser is quiet unless told otherwise - this one reports to the console
+        MidiConsoleDiagnostics console;
+        MidiParseOptions options;
+        options.diagnostics = &console;
+        MidiFile midi(midistream, options);
 
         // Then we do a little test. This function  also "MidiFile.hpp"
         // will merge all tracks into a single vector - sorted all merged 
@@ -34,395 +87,474 @@ int main() {
         midi_test_read(midi, 300);
     }
 }
+#endif // ! MIDI_FUZZ
 
 
 
-void debug_print_hex(uint32_t val) {
-    auto flgs = std::cout.flags();
-    std::cout << "0x" << std::hex << std::setw(8) << std::setfill('0') << val << '\n';
-    std::cout.flags(flgs);
-};
-
 // we are currently only interested in note on-/off messages
 
-MidiFile::MidiFile(std::ifstream& file) { 
-    parse_midi_file(file); 
-}
-
-void MidiFile::parse_midi_file(std::ifstream& file) {
+namespace {
 
-    auto swap_32 = [](uint32_t chunk) {
-        return ((chunk >> 24) | ((chunk >> 8) & 0x0000FF00) | ((chunk << 8) & 0x00FF0000) | (chunk << 24));
-    };
-    auto swap_16 = [](uint16_t chunk) {
-        return chunk >> 8 | chunk << 8;
-    };
-    auto midi_string = [&file](uint32_t length) {
-        std::string s;
-        for (uint32_t i = 0; i < length; ++i)
-            s += file.get();
-        return s;
-    };
-    // Some numbers like length of text and sysex will need anything from 1-4 bytes to
-    // be exressed. Only 7 bits of each byte is used to form a 7, 14, 21 or 28 bit number.
-    // read_multi_bytes does the bit shifting.
-    // DO NOT swap numbers after reading multi byte numbers...
-    auto read_multi_bytes = [&file]() { // should probably throw if prematue eof()
-        uint32_t result;
-        uint8_t bt;
-
-        result = file.get();
-
-        // check if bit 8 is set
-        // then the up to 4 bytes may be needed to resolve the value.
-        if (result & 0x80) {
-
-            // clear bit 8, and keep reading bytes until bit 8 is zero
-            result &= 0x7F;
-            do {
-                bt = file.get();
-                result = result << 7; // make place for new 7 bits
-                result |= (bt & 0x7F); // put last 7 bits. Results become 14, 21 or 28 bits
-            } while (bt & 0x80);
+    // Errors from a track know where in their chunk they happened, callers want the offset
+    // into the file
+    template <typename F>
+    void in_chunk(size_t chunk_offset, F&& f) {
+        try {
+            f();
+        }
+        catch (const MidiParseError& e) {
+            if (e.offset() == MidiParseError::unknown_offset)
+                throw;
+            throw MidiParseError(e.code(), e.what(), chunk_offset + e.offset());
         }
-        return result;
-    };
-    //auto skip_read = [&file](uint32_t bytes_left_to_skip) {
-    //    // Realizing that I can better use file.seekg to move number of bytes into the stream
-    //    // but anyways.... 
-    //    static char buffer[256];            
-    //    while (bytes_left_to_skip) {
-    //        uint32_t chunk_size = bytes_left_to_skip > 256 ? 256 : bytes_left_to_skip;
-    //        file.read(buffer, chunk_size);
-    //        bytes_left_to_skip -= chunk_size;
-    //    }
-    //}
-
-    // read in the midi file - a few scratch variables
-    uint32_t tmp32;
-    uint16_t tmp16;
-
-    // 4 byte file header file id 0x6468544d TMhd
-    file.read((char*)&file_id, sizeof(uint32_t));
-    if (!(file_id & 0x6468544d)) {
-        std::cerr << "File does not appear to be a valid midi-file:\n";
-        return;
-    }
-
-    // next are 3 16 bit ints - only interested in number of tracks and maybe timing
-    // 4 byte header length should be six... for now read and ignore some data
-    file.read((char*)&tmp32, sizeof(uint32_t));
-
-    // read and ignore format
-    file.read((char*)&tmp16, sizeof(uint16_t));
-
-    // read number of tracks
-    file.read((char*)&tmp16, sizeof(uint16_t));
-    num_tracks = swap_16(tmp16);
-    debug_print_hex(num_tracks);
-
-    // read time standard and resolution
-    file.read((char*)&tmp16, sizeof(uint16_t));
-    tmp16 = swap_16(tmp16);
-    SMPTE = tmp16 & 0x8000; // highest bit set => SMPTE
-    if (SMPTE) {
-        // frames per second
-        // TODO: need another midi file to test this.
-        fps = ((~((tmp16 & 0xEF00) >> 8)) + 1) & 0x00FF; // Two's complement of bit 8-15... gotta be abetter way
-        std::cout << "fps: " << fps;
-
-        // subframes per second
-        sfps = tmp16 & 0x00FF;
-    }
-    else
-    {
-        ppqn = tmp16 & 0xEFFF;
     }
 
-
-    // Go through each midi track. Each track has all its content/chunks
-    // in contigous areas in the file.
-    for (uint16_t trk = 0; trk < num_tracks; ++trk) {
-
-        // read track header then consume the events            
-        file.read((char*)&tmp32, sizeof(uint32_t));
-
-        // length in bytes of track chunk
-        file.read((char*)&tmp32, sizeof(uint32_t));
-        uint32_t numBytes = swap_32(tmp32);
-        std::cout << "TRACK --- " << trk << " --- (" << numBytes << " bytes long)\n";
-
-        tracks.push_back(MidiTrack());
-
-        bool end_of_track = false;
-        uint8_t prev_status = 0; // needed for "running state" where several midi events share a previous status
-
-        while (!file.eof() && !end_of_track)
-        {
-            // read deltatimes 2 bytes, and then status (type of operation)
-            uint32_t    delta_time = 0;
-            uint8_t     status = 0;
-            uint8_t     note = 0;
-            uint8_t     velocity = 0;
-            uint8_t     channel = 0;
-
-            uint32_t    length = 0;
-            std::string tmp_string;
-
-            delta_time = read_multi_bytes(); // DO NOT SWAP the decoded multi bytes
-            status = file.get();
-
-            // check if running state and restore previous status if so
-            if (status < 0x80) { // this is not a status byte - but midi event data
-                // move back a position in the stream or else the next reads will be off
-                file.seekg(-1, std::ios::cur);
+    // Walks a track the way decode_track does, but only looks at the metas. Channel
+    // messages are stepped over by their length from the table, nothing is stored.
+    void scan_track(std::span<const std::byte> bytes, MidiTrackInfo& info, std::vector<TempoChange>& tempo_changes) {
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(bytes.data());
+        MidiByteCursor chunk{ data, data + bytes.size() };
+
+        uint32_t tick = 0;
+        uint8_t prev_status = 0;
+        while (chunk.remaining()) {
+            // most delta times are a single byte
+            if (*chunk.pos < 0x80)
+                tick += *chunk.pos++;
+            else
+                tick += chunk.read_multi_bytes();
+            uint8_t status = chunk.get();
+            if (status < 0x80) { // running status
+                --chunk.pos;
                 status = prev_status;
+                if (!status)
+                    continue; // data with nothing to run on - decode_track warns about these
             }
+            ++info.events;
 
-            uint8_t opcode = status & 0xF0;
-
-            switch (opcode) {
-
-            case EventType::NoteOff:  // Most implementation uses NoteOn with velocity==0 a NoteOff   
+            uint8_t num_data = midi_data_length[status];
+            if (num_data != midi_variable_length) {
                 prev_status = status;
-                channel = status & 0x0F; // channel 0-16, lowest 4 bits
-                note = file.get();
-                velocity = file.get(); // not used for anything but part of standard event
-                tracks[trk].events.push_back({ MidiEvent::EventType::NoteOff, delta_time, note, velocity, channel });
-                break;
+                chunk.need(num_data);
+                info.notes += (status & 0xF0) == 0x90 && chunk.pos[1] > 0;
+                chunk.pos += num_data;
+                continue;
+            }
 
-            case EventType::NoteOn:
-                prev_status = status;
-                channel = status & 0x0F; // channel 0-16, lowest 4 bits
-                note = file.get();
-                velocity = file.get();
-                if (velocity > 0)
-                    tracks[trk].events.push_back({ MidiEvent::EventType::NoteOn, delta_time, note, velocity, channel });
-                else // running state it's a NoteOff event.
-                    tracks[trk].events.push_back({ MidiEvent::EventType::NoteOff, delta_time, note, velocity, channel });
+            prev_status = 0;
+            if (status == 0xF0 || status == 0xF7) {
+                chunk.skip(chunk.read_multi_bytes());
+                continue;
+            }
+            uint8_t type = chunk.get();
+            uint32_t length = chunk.read_multi_bytes();
+            std::string_view text = chunk.midi_string(length);
+            auto payload = reinterpret_cast<const uint8_t*>(text.data());
+            switch (type) {
+            case 0x02: info.copyright = text; break;
+            case 0x03: info.name = text; break;
+            case 0x04: info.instrument = text; break;
+            case 0x21:
+                if (length >= 1)
+                    info.port = payload[0];
                 break;
-
-            case EventType::ControlChange:
-                prev_status = status;
-                file.seekg(2, std::ios::cur); // we don't care     
-                tracks[trk].events.push_back({ MidiEvent::EventType::Other, delta_time, 0, 0, 0 });
+            case 0x51:
+                if (length >= 3)
+                    tempo_changes.push_back({ tick, uint32_t((payload[0] << 16) | (payload[1] << 8) | payload[2]) });
                 break;
+            case 0x2F:
+                info.end_tick = tick;
+                return;
+            }
+        }
+        info.end_tick = tick;
+    }
+}
 
-            case EventType::ProgramChange:
-                prev_status = status;
-                // channel = status & 0x0F;
-                // program = file.get();
-                file.get(); // we don't save
-                tracks[trk].events.push_back({ MidiEvent::EventType::Other, delta_time, 0, 0, 0 });
-                break;
+MidiFile::MidiFile(std::ifstream& file, const MidiParseOptions& options) {
+    // One bulk read of whatever is left in the stream instead of a get() per byte
+    auto start = file.tellg();
+    file.seekg(0, std::ios::end);
+    auto stop = file.tellg();
+    file.seekg(start);
+
+    if (start >= 0 && stop > start) {
+        owned_bytes.resize(static_cast<size_t>(stop - start));
+        file.read(reinterpret_cast<char*>(owned_bytes.data()), owned_bytes.size());
+        owned_bytes.resize(static_cast<size_t>(file.gcount()));
+    }
+    parse_midi_file(owned_bytes, options, decoders_for(options));
+}
 
-            case EventType::PitchBend:
-                prev_status = status;
-                // channel = status & 0x0F;
-                // amount = next two bytes
-                file.seekg(2, std::ios::cur); // skip two
-                tracks[trk].events.push_back({ MidiEvent::EventType::Other, delta_time, 0, 0, 0 });
-                break;
+MidiFile::MidiFile(std::span<const std::byte> bytes, const MidiParseOptions& options) {
+    parse_midi_file(bytes, options, decoders_for(options));
+}
 
-            case EventType::AfterTouch:
-                prev_status = status;
-                // channel = status & 0x0F;
-                // note/key = file.get();
-                // amount = file.get();
-                tracks[trk].events.push_back({ MidiEvent::EventType::Other, delta_time, 0, 0, 0 });
-                file.seekg(2, std::ios::cur); // skip two
-                break;
+MidiFile::MidiFile(MidiFileMapping map, const MidiParseOptions& options)
+    : mapping(std::move(map))
+{
+    parse_midi_file(mapping->bytes(), options, decoders_for(options));
+}
 
-            case EventType::ChannelPressure:
-                prev_status = status;
-                // channel = status & 0x0F;
-                // amount = file.get();
-                file.get(); // we don't care
-                tracks[trk].events.push_back({ MidiEvent::EventType::Other, delta_time, 0, 0, 0 });
-                break;
+MidiFile::MidiFile(std::vector<std::byte>&& bytes, const MidiParseOptions& options)
+    : owned_bytes(std::move(bytes))
+{
+    parse_midi_file(owned_bytes, options, decoders_for(options));
+}
 
-            case EventType::SysExAndMeta: // Really system exclusive and metadata...
-                prev_status = 0;
-                // You need to add these events as well - or accumulate the none Note-Off/On deltatimes
-                // to adjust note on/off times for correct note-spacing. I choose to add.
-                tracks[trk].events.push_back({ MidiEvent::EventType::Other, delta_time, 0, 0, 0 });
-
-                if (status == 0xF7 || status == 0xF0) { // System exclusive type 1 (not escaped)
-                    prev_status = 0;
-                    uint32_t length = read_multi_bytes();
-                    file.seekg(length, std::ios::cur); // skip                        
-                }
-                else   // Meta event 
-                {
-                    uint8_t  type = file.get();
-                    switch (type) {
-                    case 0x00: // Sequence number FF 00 ss ss
-                        file.seekg(2, std::ios::cur); // skip  two                       
-                        break;
-                    case 0x01: // text: FF 01 multibytelength <string>
-                        length = read_multi_bytes();
-                        tmp_string = midi_string(length);
-                        break;
-                    case 0x02: // copyright: FF 02 multibytelength <string>
-                        length = read_multi_bytes();
-                        std::cout << "COPYRIGHT: " << midi_string(length) << '\n';
-                        break;
-                    case 0x03: // FF 03 length text Track or sequence name. 
-                        length = read_multi_bytes();
-                        tmp_string = midi_string(length);
-                        //std::cout << "TRACK NAME: " << tmp_string << '\n';
-                        tracks[trk].name = tmp_string;
-                        break;
-                    case 0x04: // Instrument name
-                        length = read_multi_bytes();
-                        tmp_string = midi_string(length);
-                        std::cout << "INSTRUMENT NAME: " << tmp_string << '\n';
-                        tracks[trk].instrument = tmp_string;
-                        break;
-                    case 0x05: // Lyric
-                        length = read_multi_bytes();
-                        tmp_string = midi_string(length);
-                        //std::cout << "Lyric event: " << tmp_string << '\n'; // Don't keep                            
-                        break;
-                    case 0x06: // Marker
-                        length = read_multi_bytes();
-                        tmp_string = midi_string(length);
-                        //std::cout << "Marker found: " << tmp_string << '\n';
-                        break;
-                    case 0x07: // Cue point
-                        length = read_multi_bytes();
-                        tmp_string = midi_string(length);
-                        //std::cout << "CUE POINT: " << tmp_string << '\n';                            
-                        break;
-                    case 0x08: // Program name
-                        length = read_multi_bytes();
-                        tmp_string = midi_string(length);
-                        //std::cout << "PROGRAM NAME: " << tmp_string << '\n';
-                        break;
-                    case 0x09: // Device name
-                        length = read_multi_bytes();
-                        tmp_string = midi_string(length);
-                        //std::cout << "DEVICE NAME: " << tmp_string << '\n';
-                        break;
-                    case 0x20: // FF 20 01 cc Midi Channel Prefix                            
-                        file.seekg(2, std::ios::cur); // skip  two    
-                        break;
-                    case 0x21: // FF 21 01 pp Midi Port
-                        file.get(); // Read the 01
-                        tracks[trk].port = file.get();
-                        break;
-                    case 0x2F: // FF 2F 00 End of track                            
-                        file.get(); // should be 00                            
-                        end_of_track = true;
-                        break;
-                    case 0x51: // FF 51 03 tt tt tt tempo
-                        file.seekg(4, std::ios::cur); // skip  five                            
-                        break;
-                    case 0x54: // FF 54 05 hr mn se fr ff - SMPTE offset
-                        file.seekg(6, std::ios::cur); // skip  payload                            
-                        break;
-                    case 0x58: // FF 58 04 nn dd cc bb - Time signature
-                        file.seekg(5, std::ios::cur); // skip  payload                            
-                        break;
-                    case 0x59: // FF 59 02 sf mi - Key signature
-                        file.seekg(3, std::ios::cur); // skip  payload                            
-                        break;
-                    case 0x7F: // FF 7F length data - Sequencer specific
-                        length = read_multi_bytes();
-                        file.seekg(length, std::ios::cur); // skip  payload                         
-                        break;
-                    default:
-                        std::cerr << "ERR: We really should not be here :|\n";
-                    } // end switch case META
-
-                } // if some kind of sysex or meta
-                break;
-            default:
-                std::cerr << "ERR: Nope - Should not be here\n";
-            } // case status messages
-        } // end loop track events            
-        std::cout << '\n';
-    } // loop through tracks     
+std::optional<MidiFile::Header> MidiFile::read_header(std::span<const std::byte> bytes) {
+
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(bytes.data());
+    MidiByteCursor file{ data, data + bytes.size() };
+    Header h;
+
+    // 4 byte file header file id 0x6468544d TMhd - all four bytes of it
+    if (!is_midi(bytes))
+        return std::nullopt;
+    std::memcpy(&h.file_id, file.pos, sizeof(uint32_t));
+    file.skip(sizeof(uint32_t));
+
+    // next are 3 16 bit ints - format, number of tracks and time division
+    // 4 byte header length should be six, but respect it if it is longer
+    uint32_t length = file.get_32();
+    if (length < 6)
+        file.fail(MidiErrc::BadHeader, "Midi header too short");
+    if (length > file.remaining())
+        file.fail(MidiErrc::ChunkOverrun, "Midi header runs past the end of the file");
+    MidiByteCursor header = file;
+    file.skip(length);
+    header.end = file.pos;
+
+    h.format = header.get_16();
+    h.num_tracks = header.get_16();
+    h.division = header.get_16();
+
+    // Walk the chunk headers only. Every MTrk carries its length in bytes so the whole
+    // file can be indexed without decoding a single event.
+    // A length past the end of the file fails here, before any decoding is done.
+    while (h.chunks.size() < h.num_tracks && file.remaining() >= 8) {
+        uint32_t chunk_id = file.get_32();
+        uint32_t numBytes = file.get_32();
+        size_t offset = file.offset();
+        if (numBytes > file.remaining())
+            file.fail(MidiErrc::ChunkOverrun, "Chunk runs past the end of the file");
+        file.skip(numBytes);
+        if (chunk_id == 0x4D54726B) // "MTrk" - anything else is an alien chunk we must skip
+            h.chunks.push_back({ offset, numBytes });
+    }
+    return h;
+}
 
+MidiFileInfo MidiFile::scan(std::span<const std::byte> bytes) {
+    MidiFileInfo info;
+    auto header = read_header(bytes);
+    if (!header)
+        return info;
+
+    info.format = header->format;
+    info.num_tracks = header->num_tracks;
+    info.division = header->division;
+    info.tracks.resize(header->chunks.size());
+    for (size_t trk = 0; trk < info.tracks.size(); ++trk)
+        in_chunk(header->chunks[trk].offset, [&] {
+            scan_track(bytes.subspan(header->chunks[trk].offset, header->chunks[trk].length), info.tracks[trk], info.tempo_changes);
+        });
+    return info;
+}
 
-    // And convert the events to notes with duration
-    // Creating Notes list
-    for (auto& t : tracks) {
+TempoMap MidiFileInfo::tempo_map() const {
+    if (division & 0x8000)
+        return TempoMap::smpte(static_cast<uint8_t>(-static_cast<int8_t>(division >> 8)), division & 0x00FF);
+    return TempoMap(division & 0x7FFF, tempo_changes);
+}
+
+MidiFile::TrackDecoders MidiFile::decoders_for(const MidiParseOptions& options) {
+    using Storage = MidiEventStorage;
+    bool columns = options.storage == Storage::Columns;
+    if (options.full_fidelity) {
+        if (columns)
+            return options.strict ? decoders_for<MidiParsePolicy<midi_keep_all, Storage::Columns, true>>()
+                                  : decoders_for<MidiParsePolicy<midi_keep_all, Storage::Columns>>();
+        return options.strict ? decoders_for<MidiParsePolicy<midi_keep_all, Storage::Events, true>>()
+                              : decoders_for<MidiFullFidelity>();
+    }
+    if (columns)
+        return options.strict ? decoders_for<MidiParsePolicy<midi_keep_notes, Storage::Columns, true>>()
+                              : decoders_for<MidiParsePolicy<midi_keep_notes, Storage::Columns>>();
+    return options.strict ? decoders_for<MidiParsePolicy<midi_keep_notes, Storage::Events, true>>()
+                          : decoders_for<MidiNotesOnly>();
+}
 
-        uint32_t running_time = 0;
+void MidiFile::parse_midi_file(std::span<const std::byte> bytes, const MidiParseOptions& options, TrackDecoders decoders) {
+
+    // Phase timers only run when somebody listens
+    diagnostics = options.diagnostics;
+    using clock = std::chrono::steady_clock;
+    auto phase_start = diagnostics ? clock::now() : clock::time_point{};
+    auto end_phase = [&](MidiPhase phase) {
+        if (!diagnostics)
+            return;
+        auto now = clock::now();
+        diagnostics->phase(phase, std::chrono::duration<double>(now - phase_start).count());
+        phase_start = now;
+    };
 
-        auto& events = t.events;
-        auto& notes = t.notes;
-        std::map<uint8_t, MidiEvent> being_processed;
+    auto header = read_header(bytes);
+    if (!header) {
+        if (options.strict)
+            throw MidiParseError(MidiErrc::NotMidi, "File does not appear to be a valid midi-file", 0);
+        if (diagnostics)
+            diagnostics->warning("File does not appear to be a valid midi-file");
+        return;
+    }
+    if (header->chunks.size() < header->num_tracks) {
+        if (options.strict)
+            throw MidiParseError(MidiErrc::TrackCountMismatch, "Fewer track chunks than the header says", bytes.size());
+        if (diagnostics)
+            diagnostics->warning("Fewer track chunks than the header says");
+    }
+    file_id = header->file_id;
+    num_tracks = header->num_tracks;
+    if (diagnostics)
+        diagnostics->header(header->format, num_tracks, header->division);
 
-        for (auto e : events) {
+    // time standard and resolution
+    SMPTE = header->division & 0x8000; // highest bit set => SMPTE
+    if (SMPTE) {
+        // frames per second
+        // TODO: need another midi file to test this.
+        fps = static_cast<uint8_t>(-static_cast<int8_t>(header->division >> 8)); // bit 8-15 hold -fps as two's complement
 
-            running_time += e.delta_time;
+        // subframes per second (ticks per frame)
+        sfps = header->division & 0x00FF;
+    }
+    else
+    {
+        ppqn = header->division & 0x7FFF;
+    }
+    track_chunks = std::move(header->chunks);
+    end_phase(MidiPhase::Header);
+
+    // Decoded, a file takes several times its size (a 16 byte MidiEvent for every 2-4 bytes,
+    // notes, payloads, and what vector growth leaves behind in a monotonic arena). A first
+    // block big enough for all of it means one upstream allocation per file - several
+    // smaller ones go to mmap and back for every file, page faults and all. Pages that are
+    // never touched cost nothing.
+    size_t arena_size = std::min(bytes.size() * 8, size_t{ 64 } << 20);
+
+    // Lazy: that is all for now, track() and friends decode on demand
+    if (options.lazy) {
+        make_tracks(track_chunks.size(), arena_size);
+        lazy = std::make_unique<LazyTracks>();
+        lazy->bytes = bytes;
+        lazy->options = options;
+        lazy->decoders = decoders;
+        lazy->decoded = std::make_unique<std::once_flag[]>(tracks.size());
+        return;
+    }
 
-            if (e.event == MidiEvent::EventType::NoteOn)
-            {
-                e.delta_time = running_time; // it's a copy of the event so we use it as a scratch variable
-                being_processed.insert({ e.note, e });
+    // Second pass: tracks are independent of each other (each has its own running
+    // status) so they can be decoded and paired concurrently.
+    make_tracks(track_chunks.size(), arena_size);
+
+    // A constructor that throws skips ~MidiFile and its members go in reverse order - the
+    // arena before the tracks that live in it. A failed decode lets go of them itself.
+    struct ReleaseOnThrow {
+        std::vector<MidiTrack>& tracks;
+        int exceptions = std::uncaught_exceptions();
+        ~ReleaseOnThrow() {
+            if (std::uncaught_exceptions() > exceptions)
+                tracks.clear();
+        }
+    } release_on_throw{ tracks };
+    std::vector<std::vector<TempoChange>> tempo_changes(tracks.size());
+    // one pairing table per worker, reused for every track it decodes
+    size_t workers = std::min<size_t>(options.num_threads, tracks.size());
+    std::vector<MidiNotePairer> pairers(std::max<size_t>(workers, 1));
+    std::vector<MidiTrackStats> stats(diagnostics ? tracks.size() : 0);
+    auto decode = [&](size_t trk, MidiNotePairer& pairer) {
+        auto chunk = bytes.subspan(track_chunks[trk].offset, track_chunks[trk].length);
+        in_chunk(track_chunks[trk].offset, [&] {
+            if (!diagnostics) {
+                decoders.plain(chunk, tracks[trk], options, tempo_changes[trk], pairer, nullptr);
+                return;
             }
-            else if (e.event == MidiEvent::EventType::NoteOff) {
-                auto result = being_processed.find(e.note);
-                if (result != being_processed.end()) {
-                    auto on_event = result->second;
-                    notes.push_back({ on_event.note, on_event.velocity, on_event.delta_time, running_time - on_event.delta_time });
-                    being_processed.erase(e.note);
-                }
+            auto start = clock::now();
+            decoders.instrumented(chunk, tracks[trk], options, tempo_changes[trk], pairer, &stats[trk]);
+            stats[trk].seconds = std::chrono::duration<double>(clock::now() - start).count();
+        });
+    };
+
+    if (workers <= 1) {
+        for (size_t trk = 0; trk < tracks.size(); ++trk)
+            decode(trk, pairers[0]);
+    }
+    else {
+        // Hand out the biggest tracks first so a long one doesn't end up last in line
+        std::vector<size_t> order(tracks.size());
+        std::iota(order.begin(), order.end(), size_t{ 0 });
+        std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            return track_chunks[a].length > track_chunks[b].length;
+        });
+
+        std::atomic<size_t> next{ 0 };
+        std::vector<std::exception_ptr> errors(workers);
+        auto worker = [&](size_t w) {
+            try {
+                for (size_t i = next++; i < order.size(); i = next++)
+                    decode(order[i], pairers[w]);
             }
-        }
+            catch (...) {
+                errors[w] = std::current_exception();
+                next = order.size(); // no point in the others carrying on
+            }
+        };
+
+        std::vector<std::thread> pool;
+        pool.reserve(workers - 1);
+        for (size_t w = 1; w < workers; ++w)
+            pool.emplace_back(worker, w);
+        worker(0); // the calling thread pulls its weight too
+        for (auto& t : pool)
+            t.join();
+
+        for (auto& e : errors)
+            if (e)
+                std::rethrow_exception(e);
     }
-}
 
-void midi_test_read(const MidiFile& midi, size_t num_sorted_to_print)
-{
+    end_phase(MidiPhase::Decode);
 
-    std::vector<MidiTrack> tracks = midi.midi_tracks(); // copy
-    
+    // Tempo events can live in any track (format 1 should keep them in the first)
+    if (SMPTE)
+        tempo = TempoMap::smpte(fps, sfps);
+    else {
+        std::vector<TempoChange> all_changes;
+        for (const auto& changes : tempo_changes)
+            all_changes.insert(all_changes.end(), changes.begin(), changes.end());
+        tempo = TempoMap(ppqn, std::move(all_changes));
+    }
 
-    // for the fun of it... sort all event vectors into one single vector
-    // Thinking that would have to be the view for a sequencer
-    // I would loose data without the track info. But for now lets try
+    end_phase(MidiPhase::TempoMap);
 
-    uint32_t total_num_events = 0;
-    // Get size needed for all events merged. 
-    for (uint32_t i = 0; i < tracks.size(); ++i)
-        total_num_events += tracks[i].notes.size();
+    // Reported in track order once everything is decoded so the threads don't interleave
+    for (size_t trk = 0; diagnostics && trk < tracks.size(); ++trk)
+        diagnostics->track(trk, tracks[trk], stats[trk]);
+}
 
-    std::vector<MidiNote> all_tracks_merged;
-    all_tracks_merged.reserve(total_num_events);
+void MidiFile::make_tracks(size_t count, size_t arena_size) {
+    tracks.clear();
+    arena = std::make_unique<MidiArena>(arena_size);
+    tracks.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+        tracks.emplace_back(arena.get());
+}
 
-    // We prepare the sort... keeping one vector with curent index of each track
-    std::vector<size_t> current_pos(tracks.size(), { 0 });  // index of where we are in each vector  
+const MidiTrack& MidiFile::track(size_t i) const {
+    if (lazy)
+        std::call_once(lazy->decoded[i], [this, i] { decode_lazy(i); });
+    return tracks[i];
+}
 
-    for (size_t tr_idx = 0; tr_idx < tracks.size(); ++tr_idx) {
+MidiOwnedTracks MidiFile::take_tracks() {
+    decode_all();
+    tempo_map(); // a lazy file builds it from the bytes that are about to go
+
+    MidiOwnedTracks out;
+    out.tracks = std::move(tracks);
+    out.owned_bytes = std::move(owned_bytes);
+    out.mapping = std::move(mapping);
+    out.arena = std::move(arena);
+    tracks.clear();
+    owned_bytes.clear();
+    mapping.reset();
+    return out;
+}
 
-        while (current_pos[tr_idx] < tracks[tr_idx].notes.size()) {
+void MidiFile::decode_all() const {
+    for (size_t trk = 0; lazy && trk < tracks.size(); ++trk)
+        track(trk);
+}
 
-            size_t winner_track = tr_idx; // we cross fingers for main track
-            auto min_val = tracks[tr_idx].notes[current_pos[tr_idx]].start_time;
+void MidiFile::decode_lazy(size_t trk) const {
+    auto chunk = lazy->bytes.subspan(track_chunks[trk].offset, track_chunks[trk].length);
+    std::vector<TempoChange> tempo_changes; // the tempo map comes from a scan, see tempo_map()
+    MidiNotePairer pairer;
+    if (!diagnostics) {
+        in_chunk(track_chunks[trk].offset, [&] { lazy->decoders.plain(chunk, tracks[trk], lazy->options, tempo_changes, pairer, nullptr); });
+        return;
+    }
+    MidiTrackStats stats;
+    auto start = std::chrono::steady_clock::now();
+    in_chunk(track_chunks[trk].offset, [&] { lazy->decoders.instrumented(chunk, tracks[trk], lazy->options, tempo_changes, pairer, &stats); });
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    diagnostics->track(trk, tracks[trk], stats);
+}
 
-            for (size_t sub_tx = tr_idx + 1; sub_tx < tracks.size(); ++sub_tx)
-            {
-                if (current_pos[sub_tx] < tracks[sub_tx].notes.size()) {
-                    auto contester = tracks[sub_tx].notes[current_pos[sub_tx]].start_time;
-                    if (min_val > contester) {
-                        min_val = contester;
-                        winner_track = sub_tx;
-                    }
-                }
+const TempoMap& MidiFile::tempo_map() const {
+    // Lazy files find their tempo events with the meta scan rather than decoding every track
+    if (lazy) {
+        std::call_once(lazy->tempo_once, [this] {
+            auto start = std::chrono::steady_clock::now();
+            if (SMPTE)
+                tempo = TempoMap::smpte(fps, sfps);
+            else {
+                std::vector<TempoChange> changes;
+                MidiTrackInfo info;
+                for (const auto& c : track_chunks)
+                    in_chunk(c.offset, [&] { scan_track(lazy->bytes.subspan(c.offset, c.length), info, changes); });
+                tempo = TempoMap(ppqn, std::move(changes));
             }
-            all_tracks_merged.push_back(tracks[winner_track].notes[current_pos[winner_track]]);
-            current_pos[winner_track]++;
-        }
+            if (diagnostics)
+                diagnostics->phase(MidiPhase::TempoMap, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        });
     }
+    return tempo;
+}
 
-    size_t counter = 0;
-    for (size_t i = 0; i < num_sorted_to_print; ++i )
+const std::vector<MergedNote>& MidiFile::merged_notes() const {
+    decode_all();
+    std::call_once(merge_cache->notes_once, [this] {
+        auto start = std::chrono::steady_clock::now();
+        size_t total = 0;
+        for (const auto& t : tracks)
+            total += t.notes.size();
+        merge_cache->notes.reserve(total);
+        for (const auto& n : merged_notes_view())
+            merge_cache->notes.push_back(n);
+        if (diagnostics)
+            diagnostics->phase(MidiPhase::MergeNotes, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    });
+    return merge_cache->notes;
+}
+
+const std::vector<MergedEvent>& MidiFile::merged_events() const {
+    decode_all();
+    std::call_once(merge_cache->events_once, [this] {
+        auto start = std::chrono::steady_clock::now();
+        size_t total = 0;
+        for (const auto& t : tracks)
+            total += t.event_count(); // events is empty when they are stored in columns
+        merge_cache->events.reserve(total);
+        for (const auto& e : merged_events_view())
+            merge_cache->events.push_back(e);
+        if (diagnostics)
+            diagnostics->phase(MidiPhase::MergeEvents, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    });
+    return merge_cache->events;
+}
+
+void midi_test_read(const MidiFile& midi, size_t num_sorted_to_print)
+{
+    // All tracks merged into one single timeline sorted by note start time.
+    // Thinking that would have to be the view for a sequencer. The view merges
+    // as we go, so nothing is copied for just printing the first few.
+    size_t printed = 0;
+    for (const auto& m : midi.merged_notes_view())
     {
-        MidiNote e = all_tracks_merged[i];
-        std::cout << e.start_time << "\t note: " << (int)e.note << "\tDuration: " << e.duration << '\n';        
-    }    
+        if (printed++ == num_sorted_to_print)
+            break;
+        const MidiNote& e = m.note;
+        std::cout << e.start_time << "\t note: " << (int)e.note << "\tDuration: " << e.duration << '\n';
+    }
 }
@@ -13,69 +13,690 @@
 // as a very simple playback sequencer. Probably not to a midi device but a time logged file or something.
 
 
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
-// we are currently only interested in note on-/off messages
+#include "MidiFileMapping.hpp"
+#include "TempoMap.hpp"
+
+class MidiNotePairer;
+class MidiDiagnostics;
+struct MidiTrackStats;
+
+// Every message in the file ends up as one of these. No variant - the two data bytes
+// mean what they mean in the midi message itself:
+//
+//   NoteOn/NoteOff     note, velocity
+//   AfterTouch         note = key, velocity = amount
+//   ControlChange      note = controller, velocity = value
+//   ProgramChange      note = program
+//   ChannelPressure    note = amount
+//   PitchBend          note = lsb, velocity = msb (see pitch_bend())
+//   SysEx              meta = F0 or F7, payload = offset into MidiTrack::payloads
+//   Meta               meta = FF type, payload = offset into MidiTrack::payloads
+//   Tempo              payload = microseconds per quarter note
+//   TimeSignature      payload = nn dd cc bb, nn in the top byte
+//   KeySignature       payload = sf mi, sf (signed) in the high byte
+//   Other              not a message - what midi_event_type() makes of a data byte. The
+//                      parser never stores one, a dropped message leaves no trace.
 
 struct MidiEvent {
-    enum class EventType {
+    enum class EventType : uint8_t {
         NoteOn,
         NoteOff,
-        Other // As with javidx9 - I will only care about note on and off.
+        AfterTouch,
+        ControlChange,
+        ProgramChange,
+        ChannelPressure,
+        PitchBend,
+        SysEx,
+        Meta,
+        Tempo,
+        TimeSignature,
+        KeySignature,
+        Other
     } event;
     uint32_t    delta_time = 0;
     uint8_t     note = 0;
     uint8_t     velocity = 0;
-    uint8_t     channel = 0; // will probably never use before moving on to another project
+    uint8_t     channel = 0;
+    uint8_t     meta = 0;
+    uint32_t    payload = 0;
+
+    int pitch_bend() const { return ((velocity << 7) | note) - 8192; }
 };
+
+// The raw status byte for an event: 0x80-0xEF with the channel for channel messages,
+// F0/F7 for sysex, FF for meta and 0 for Other
+inline uint8_t midi_event_status(const MidiEvent& e) {
+    switch (e.event) {
+    case MidiEvent::EventType::NoteOn:          return 0x90 | e.channel;
+    case MidiEvent::EventType::NoteOff:         return 0x80 | e.channel;
+    case MidiEvent::EventType::AfterTouch:      return 0xA0 | e.channel;
+    case MidiEvent::EventType::ControlChange:   return 0xB0 | e.channel;
+    case MidiEvent::EventType::ProgramChange:   return 0xC0 | e.channel;
+    case MidiEvent::EventType::ChannelPressure: return 0xD0 | e.channel;
+    case MidiEvent::EventType::PitchBend:       return 0xE0 | e.channel;
+    case MidiEvent::EventType::SysEx:           return e.meta;
+    case MidiEvent::EventType::Meta:
+    case MidiEvent::EventType::Tempo:
+    case MidiEvent::EventType::TimeSignature:
+    case MidiEvent::EventType::KeySignature:    return 0xFF;
+    default:                                    return 0;
+    }
+}
+
+// Which MidiEvent a raw status byte turns into. data1 is the meta type for FF, data2
+// tells note on from a note off in disguise (velocity 0).
+constexpr MidiEvent::EventType midi_event_type(uint8_t status, uint8_t data1, uint8_t data2) {
+    switch (status & 0xF0) {
+    case 0x90: return data2 > 0 ? MidiEvent::EventType::NoteOn : MidiEvent::EventType::NoteOff;
+    case 0x80: return MidiEvent::EventType::NoteOff;
+    case 0xA0: return MidiEvent::EventType::AfterTouch;
+    case 0xB0: return MidiEvent::EventType::ControlChange;
+    case 0xC0: return MidiEvent::EventType::ProgramChange;
+    case 0xD0: return MidiEvent::EventType::ChannelPressure;
+    case 0xE0: return MidiEvent::EventType::PitchBend;
+    case 0xF0:
+        if (status != 0xFF)
+            return MidiEvent::EventType::SysEx;
+        switch (data1) {
+        case 0x51: return MidiEvent::EventType::Tempo;
+        case 0x58: return MidiEvent::EventType::TimeSignature;
+        case 0x59: return MidiEvent::EventType::KeySignature;
+        default:   return MidiEvent::EventType::Meta;
+        }
+    default: return MidiEvent::EventType::Other;
+    }
+}
+
+// The whole event in 8 bytes: absolute tick in the low 32 bits, then status, data1 and
+// data2. A million of them is 8MB - small enough to scan for a channel or note at memory speed.
+// Channel messages fit completely, for sysex/meta data1 is the type and the payload is
+// left behind in the columns.
+struct PackedMidiEvent {
+    uint64_t    bits = 0;
+
+    static constexpr PackedMidiEvent pack(uint32_t tick, uint8_t status, uint8_t data1, uint8_t data2) {
+        return { uint64_t(tick) | uint64_t(status) << 32 | uint64_t(data1) << 40 | uint64_t(data2) << 48 };
+    }
+    constexpr uint32_t tick() const { return static_cast<uint32_t>(bits); }
+    constexpr uint8_t status() const { return static_cast<uint8_t>(bits >> 32); }
+    constexpr uint8_t data1() const { return static_cast<uint8_t>(bits >> 40); }
+    constexpr uint8_t data2() const { return static_cast<uint8_t>(bits >> 48); }
+    constexpr uint8_t channel() const { return status() & 0x0F; }
+    MidiEvent::EventType type() const { return midi_event_type(status(), data1(), data2()); }
+};
+static_assert(sizeof(PackedMidiEvent) == 8);
+
+// Column (structure of arrays) storage for a track's events, one array per field.
+// Indexing or iterating gives MidiEvent values built on the fly, so code written
+// against MidiTrack::events keeps working.
+struct MidiEventColumns {
+    std::pmr::vector<uint32_t>  tick;   // absolute time in ticks
+    std::pmr::vector<uint8_t>   status; // raw status byte, channel in the low nibble for channel messages
+    std::pmr::vector<uint8_t>   data1;  // first data byte, or the meta type for FF
+    std::pmr::vector<uint8_t>   data2;  // second data byte
+    std::pmr::vector<uint32_t>  payload;// MidiEvent::payload - only meaningful for sysex/meta
+
+    MidiEventColumns() = default;
+    explicit MidiEventColumns(std::pmr::memory_resource* arena)
+        : tick(arena), status(arena), data1(arena), data2(arena), payload(arena) {}
+
+    size_t size() const { return tick.size(); }
+    bool empty() const { return tick.empty(); }
+
+    void push_back(uint32_t t, const MidiEvent& e) {
+        uint8_t s = midi_event_status(e);
+        tick.push_back(t);
+        status.push_back(s);
+        data1.push_back(s >= 0xF0 ? e.meta : e.note);
+        data2.push_back(s >= 0xF0 ? 0 : e.velocity);
+        payload.push_back(e.payload);
+    }
+
+    MidiEvent operator[](size_t i) const {
+        uint32_t delta = i ? tick[i] - tick[i - 1] : tick[i];
+        uint8_t s = status[i];
+        auto type = midi_event_type(s, data1[i], data2[i]);
+        if (s >= 0xF0)
+            return { type, delta, 0, 0, 0, s == 0xFF ? data1[i] : s, payload[i] };
+        if (type == MidiEvent::EventType::Other)
+            return { type, delta, 0, 0, 0 };
+        return { type, delta, data1[i], data2[i], static_cast<uint8_t>(s & 0x0F) };
+    }
+    PackedMidiEvent packed(size_t i) const {
+        return PackedMidiEvent::pack(tick[i], status[i], data1[i], data2[i]);
+    }
+    std::vector<PackedMidiEvent> pack() const {
+        std::vector<PackedMidiEvent> out(size());
+        for (size_t i = 0; i < out.size(); ++i)
+            out[i] = packed(i);
+        return out;
+    }
+
+    // Proxy iterator - dereferencing builds the MidiEvent, so it is only an input iterator
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = MidiEvent;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = MidiEvent;
+
+        iterator() = default;
+        iterator(const MidiEventColumns* cols, size_t i) : cols(cols), i(i) {}
+        MidiEvent operator*() const { return (*cols)[i]; }
+        iterator& operator++() { ++i; return *this; }
+        iterator operator++(int) { iterator tmp = *this; ++i; return tmp; }
+        bool operator==(const iterator& other) const { return i == other.i; }
+
+    private:
+        const MidiEventColumns* cols = nullptr;
+        size_t                  i = 0;
+    };
+    iterator begin() const { return { this, 0 }; }
+    iterator end() const { return { this, size() }; }
+};
+
 struct MidiNote {
     uint8_t     note = 0;
     uint8_t     velocity = 0;
+    uint8_t     channel = 0;
     uint32_t    start_time = 0; // absolute start time from beginning or delta time?
     uint32_t    duration = 0;
 };
+// The events live in either events or columns, whichever MidiEventStorage the parse was
+// asked for - the other one stays empty. Code that has to read both ways goes through
+// event_count() and event_at().
 struct MidiTrack {
-    std::string             name;
-    std::string             instrument;
-    std::vector<MidiEvent>  events;
-    std::vector<MidiNote>   notes;
-    uint8_t                 port; // may change during track? Hmm. think so    
+    std::string_view            name;       // views into the bytes the MidiFile was parsed from
+    std::string_view            instrument;
+    std::string_view            copyright;
+    std::pmr::vector<MidiEvent> events;     // only filled with MidiEventStorage::Events (the default)
+    MidiEventColumns            columns;    // only filled with MidiEventStorage::Columns
+    std::pmr::vector<MidiNote>  notes;      // in start order
+    std::pmr::vector<std::byte> payloads;   // arena for sysex and meta data, see payload()
+    uint8_t                     port = 0; // may change during track? Hmm. think so    
+
+    MidiTrack() = default;
+    // A parsed track allocates everything from its file's arena (copies use the heap)
+    explicit MidiTrack(std::pmr::memory_resource* arena)
+        : events(arena), columns(arena), notes(arena), payloads(arena) {}
+
+    // The data of a SysEx or Meta event (empty for anything else)
+    std::span<const std::byte> payload(const MidiEvent& e) const {
+        if (e.event != MidiEvent::EventType::SysEx && e.event != MidiEvent::EventType::Meta)
+            return {};
+        uint32_t length;
+        std::memcpy(&length, payloads.data() + e.payload, sizeof(length));
+        return { payloads.data() + e.payload + sizeof(length), length };
+    }
+    std::string_view text(const MidiEvent& e) const {
+        auto p = payload(e);
+        return { reinterpret_cast<const char*>(p.data()), p.size() };
+    }
+
+    // The events whichever way they were stored
+    size_t event_count() const { return columns.empty() ? events.size() : columns.size(); }
+    MidiEvent event_at(size_t i) const { return columns.empty() ? events[i] : columns[i]; }
+};
+
+// A note or event placed on the global timeline, remembering which track it came from
+struct MergedNote {
+    MidiNote    note;
+    uint16_t    track = 0;
+};
+struct MergedEvent {
+    MidiEvent   event;      // event.delta_time is still relative to its own track
+    uint32_t    time = 0;   // absolute time in ticks
+    uint16_t    track = 0;
 };
 
+// Walks all tracks in time order without copying anything - a k-way merge with one heap
+// entry per track, so each step costs O(log tracks). Ties go to the lowest track number.
+// Merged is MergedNote (ordered by start_time) or MergedEvent (ordered by absolute time).
+template <typename Merged>
+class MidiMergeView {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Merged;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Merged*;
+        using reference = const Merged&;
 
-class MidiFile {
+        iterator() = default;
+        explicit iterator(const std::vector<MidiTrack>& tracks) : tracks(&tracks) {
+            for (size_t t = 0; t < tracks.size(); ++t)
+                if (size(t))
+                    heap.push_back({ time_at(t, 0, 0), static_cast<uint16_t>(t), 0 });
+            std::make_heap(heap.begin(), heap.end(), later);
+            advance();
+        }
 
-    enum EventType : uint8_t {
-        NoteOff = 0x80,
-        NoteOn = 0x90,
-        AfterTouch = 0xA0,
-        ControlChange = 0xB0,
-        ProgramChange = 0xC0,
-        ChannelPressure = 0xD0,
-        PitchBend = 0xE0,
-        SysExAndMeta = 0xF0 // hmmm sysex1 and 2 + META        
+        reference operator*() const { return current; }
+        pointer operator->() const { return &current; }
+        iterator& operator++() { advance(); return *this; }
+        void operator++(int) { advance(); }
+        friend bool operator==(const iterator& it, std::default_sentinel_t) { return it.done; }
+
+    private:
+        struct Cursor {
+            uint32_t    time;
+            uint16_t    track;
+            size_t      pos;
+        };
+        static bool later(const Cursor& a, const Cursor& b) {
+            return a.time != b.time ? a.time > b.time : a.track > b.track;
+        }
+
+        size_t size(size_t t) const {
+            if constexpr (std::is_same_v<Merged, MergedNote>)
+                return (*tracks)[t].notes.size();
+            else
+                return (*tracks)[t].event_count();
+        }
+        // notes know their start time, events only their delta from the previous one
+        // (unless they are stored in columns)
+        uint32_t time_at(size_t t, size_t pos, uint32_t prev_time) const {
+            const MidiTrack& track = (*tracks)[t];
+            if constexpr (std::is_same_v<Merged, MergedNote>)
+                return track.notes[pos].start_time;
+            else if (!track.columns.empty())
+                return track.columns.tick[pos];
+            else
+                return prev_time + track.events[pos].delta_time;
+        }
+
+        void advance() {
+            if (heap.empty()) {
+                done = true;
+                return;
+            }
+            std::pop_heap(heap.begin(), heap.end(), later);
+            Cursor& c = heap.back();
+            if constexpr (std::is_same_v<Merged, MergedNote>)
+                current = { (*tracks)[c.track].notes[c.pos], c.track };
+            else
+                current = { (*tracks)[c.track].event_at(c.pos), c.time, c.track };
+
+            if (++c.pos < size(c.track)) {
+                c.time = time_at(c.track, c.pos, c.time);
+                std::push_heap(heap.begin(), heap.end(), later);
+            }
+            else
+                heap.pop_back();
+        }
+
+        const std::vector<MidiTrack>*   tracks = nullptr;
+        std::vector<Cursor>             heap;
+        Merged                          current{};
+        bool                            done = false;
     };
 
+    explicit MidiMergeView(const std::vector<MidiTrack>& tracks) : tracks(&tracks) {}
+    iterator begin() const { return iterator(*tracks); }
+    std::default_sentinel_t end() const { return {}; }
+
+private:
+    const std::vector<MidiTrack>* tracks;
+};
+
+// How a track keeps its events
+enum class MidiEventStorage {
+    Events,     // MidiTrack::events, one MidiEvent struct per event
+    Columns     // MidiTrack::columns, one array per field
+};
+
+// What happens to notes still sounding when their track ends
+enum class MidiDanglingNotes : uint8_t {
+    Drop,       // no note off, no note
+    EndOfTrack  // they last until the track's last event
+};
+
+// Knobs for how a MidiFile gets parsed
+struct MidiParseOptions {
+    unsigned            num_threads = 1; // tracks decoded concurrently, 1 = all on the calling thread
+    MidiEventStorage    storage = MidiEventStorage::Events;
+    bool                full_fidelity = true; // false: only note on/off and tempo are kept (MidiNotesOnly)
+    bool                strict = false; // malformed data throws MidiParseError instead of being got past
+    MidiDiagnostics*    diagnostics = nullptr; // timings, counters and warnings go here, nothing is printed without one
+    MidiDanglingNotes   dangling_notes = MidiDanglingNotes::Drop;
+    bool                lazy = false; // only index the chunks, tracks are decoded the first time they are asked for
+};
+
+// Which kinds of message a parse keeps, a bit per MidiEvent::EventType
+constexpr uint16_t midi_kind(MidiEvent::EventType type) { return uint16_t(1u << static_cast<unsigned>(type)); }
+constexpr uint16_t midi_keep_all = uint16_t(midi_kind(MidiEvent::EventType::Other) - 1);
+constexpr uint16_t midi_keep_notes = midi_kind(MidiEvent::EventType::NoteOn) | midi_kind(MidiEvent::EventType::NoteOff)
+                                   | midi_kind(MidiEvent::EventType::Tempo);
+
+// A parser configuration fixed at compile time. The track decoder is compiled per policy
+// (see MidiTrackDecoder.hpp), so a kind that isn't kept costs nothing but stepping over
+// it: channel messages by their length from a table, sysex and metas without copying
+// their payload. Track names, ports and tempo changes are always there, paired notes
+// whenever NoteOn is kept.
+template <uint16_t Keep, MidiEventStorage Storage = MidiEventStorage::Events, bool Strict = false>
+struct MidiParsePolicy {
+    static constexpr uint16_t           keep = Keep;
+    static constexpr MidiEventStorage   storage = Storage;
+    static constexpr bool               strict = Strict;
+
+    static constexpr bool keeps(MidiEvent::EventType type) { return (keep & midi_kind(type)) != 0; }
+    // Notes are paired from note messages only when NoteOn is kept - keeping just
+    // NoteOff stores the messages but pairs nothing
+    static constexpr bool pair_notes = keeps(MidiEvent::EventType::NoteOn);
+
+    // Channel status bytes that need decoding at all
+    static constexpr std::array<bool, 256> decodes = [] {
+        std::array<bool, 256> t{};
+        for (unsigned s = 0x80; s < 0xF0; ++s) {
+            if ((s & 0xF0) == 0x80 || (s & 0xF0) == 0x90)
+                t[s] = keeps(MidiEvent::EventType::NoteOn) || keeps(MidiEvent::EventType::NoteOff);
+            else
+                t[s] = keeps(midi_event_type(static_cast<uint8_t>(s), 0, 0));
+        }
+        return t;
+    }();
+    static constexpr bool decodes_channel = [] { // any of them
+        for (bool d : decodes)
+            if (d)
+                return true;
+        return false;
+    }();
+};
+using MidiFullFidelity = MidiParsePolicy<midi_keep_all>;
+using MidiNotesOnly = MidiParsePolicy<midi_keep_notes>;
+
+template <typename P>
+concept MidiPolicy = requires {
+    { P::keep } -> std::convertible_to<uint16_t>;
+    { P::storage } -> std::convertible_to<MidiEventStorage>;
+    { P::strict } -> std::convertible_to<bool>;
+};
+
+// What was wrong with the data, for callers that need more than the message
+enum class MidiErrc : uint8_t {
+    Malformed,              // nothing more specific to say
+    NotMidi,                // no MThd at the start
+    BadHeader,              // MThd shorter than its 6 bytes
+    Truncated,              // an event or header field runs past the end of its chunk
+    ChunkOverrun,           // a chunk claims more bytes than the file has left
+    LengthTooLong,          // a delta time or length of more than 4 bytes
+    MissingStatus,          // running status with no status byte to run on
+    BadData,                // status byte where a data byte was due
+    ShortMeta,              // tempo, time or key signature too short for its type
+    MissingEndOfTrack,
+    DataAfterEndOfTrack,
+    TrackCountMismatch,     // fewer track chunks than the header says
+    SystemMessage,          // an F1-F6 or F8-FE status, which has no place in a file
+};
+
+// Thrown on malformed midi data - always in strict mode, and in lenient mode for what
+// can't be got past (a chunk claiming more bytes than we were handed, an event cut off
+// by the end of its chunk). offset is where in the parsed bytes it was found.
+class MidiParseError : public std::runtime_error {
+public:
+    static constexpr uint64_t unknown_offset = UINT64_MAX;
+
+    using std::runtime_error::runtime_error;
+    MidiParseError(MidiErrc code, const char* what, uint64_t offset = unknown_offset)
+        : std::runtime_error(what), error_code(code), error_offset(offset) {}
+
+    MidiErrc code() const { return error_code; }
+    uint64_t offset() const { return error_offset; }
+
+private:
+    MidiErrc    error_code = MidiErrc::Malformed;
+    uint64_t    error_offset = unknown_offset;
+};
+
+// What MidiFile::scan() finds without decoding a track: the header fields, and per
+// track the metas and a few counts. The strings are views into the scanned bytes.
+struct MidiTrackInfo {
+    std::string_view    name;
+    std::string_view    instrument;
+    std::string_view    copyright;
+    uint8_t             port = 0;
+    uint64_t            events = 0;     // what MidiTrack::event_count() would be
+    uint64_t            notes = 0;      // note ons with a velocity
+    uint32_t            end_tick = 0;   // absolute time of the last event
+};
+struct MidiFileInfo {
+    uint16_t                    format = 0;
+    uint16_t                    num_tracks = 0; // as the header says
+    uint16_t                    division = 0;   // raw, see MidiFile::division()
+    std::vector<MidiTrackInfo>  tracks;         // one per MTrk chunk found
+    std::vector<TempoChange>    tempo_changes;  // from all tracks
+
+    TempoMap tempo_map() const;
+};
+
+
+// Where a MidiFile's tracks keep their vectors. Monotonic: an allocation is a pointer bump,
+// freeing one does nothing, and all of it goes back in one release with the file - no
+// heap churn however many files are parsed. Locked, as tracks are decoded on several threads.
+class MidiArena : public std::pmr::memory_resource {
+public:
+    explicit MidiArena(size_t initial_size) : arena(std::max<size_t>(initial_size, 1024)) {}
+
+    // Bytes handed out so far - less than the arena holds from the heap, which is
+    // reserved in blocks up front
+    size_t used() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return allocated;
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        std::lock_guard<std::mutex> guard(lock);
+        allocated += bytes;
+        return arena.allocate(bytes, alignment);
+    }
+    void do_deallocate(void*, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    mutable std::mutex                  lock;
+    std::pmr::monotonic_buffer_resource arena;
+    size_t                              allocated = 0;
+};
+
+// Tracks moved out of a MidiFile with MidiFile::take_tracks(), along with what keeps them
+// valid: the arena their vectors live in and the file bytes (owned or mapped) their names
+// point into. Bytes the MidiFile was only given a span of are still the caller's to keep.
+struct MidiOwnedTracks {
+    std::vector<MidiTrack>          tracks;
+    std::vector<std::byte>          owned_bytes;
+    std::optional<MidiFileMapping>  mapping;
+    std::unique_ptr<MidiArena>      arena;  // after tracks, so a move assignment lets go of the old tracks first
+
+    MidiOwnedTracks() = default;
+    MidiOwnedTracks(MidiOwnedTracks&&) = default;
+    MidiOwnedTracks& operator=(MidiOwnedTracks&&) = default;
+    ~MidiOwnedTracks() { tracks.clear(); } // before the arena they live in
+};
+
+
+class MidiFile {
+
 public:
-    MidiFile(std::ifstream& file);
+    // Reads the rest of the stream into a buffer owned by the MidiFile and parses that
+    MidiFile(std::ifstream& file, const MidiParseOptions& options = {});
+    // Zero copy: parses in place. The caller must keep the bytes alive as long as the
+    // MidiFile (track names etc. are views into them).
+    MidiFile(std::span<const std::byte> bytes, const MidiParseOptions& options = {});
+    // Zero copy: takes over the mapping, so the views stay valid for our lifetime
+    MidiFile(MidiFileMapping mapping, const MidiParseOptions& options = {});
+    // Takes over the buffer (an lvalue vector goes to the span overload and is not copied)
+    MidiFile(std::vector<std::byte>&& bytes, const MidiParseOptions& options = {});
+    // With a compile time policy instead of the full_fidelity/storage/strict options.
+    // Defined in MidiTrackDecoder.hpp.
+    template <MidiPolicy Policy>
+    MidiFile(std::span<const std::byte> bytes, Policy policy, const MidiParseOptions& options = {});
+    template <MidiPolicy Policy>
+    MidiFile(MidiFileMapping mapping, Policy policy, const MidiParseOptions& options = {});
+
+    // Tracks hold views into our storage - a copy would point into the wrong buffer
+    MidiFile(const MidiFile&) = delete;
+    MidiFile& operator=(const MidiFile&) = delete;
+    MidiFile(MidiFile&&) = default;
+    MidiFile& operator=(MidiFile&&) = default;
+    ~MidiFile() { tracks.clear(); } // before the arena they live in
+
+    // Header fields and track metas only - no events stored, no notes paired. Many times
+    // faster than a parse, for when names and counts are all that is needed. Empty if
+    // the bytes are not a midi file.
+    static MidiFileInfo scan(std::span<const std::byte> bytes);
+
+    // Starts with an MThd - anything else a lenient parse turns into an empty file
+    static bool is_midi(std::span<const std::byte> bytes) {
+        return bytes.size() >= 4 && std::memcmp(bytes.data(), "MThd", 4) == 0;
+    }
+
+    // A deep copy on the heap - the names still point into our bytes though
     std::vector<MidiTrack> midi_tracks() const {
+        decode_all();
+        return tracks;
+    }
+    // No copy
+    std::span<const MidiTrack> midi_tracks_view() const {
+        decode_all();
         return tracks;
     }
+    // Moves the tracks out, with the arena and bytes they need, and leaves us with none.
+    // The tempo map stays.
+    MidiOwnedTracks take_tracks();
+
+    // What the tracks' vectors take up in their arena
+    size_t arena_bytes() const { return arena ? arena->used() : 0; }
+
+    // One track, decoded on the spot if the file was opened lazily and nobody asked for
+    // it before. Safe to call from several threads.
+    size_t track_count() const { return tracks.size(); }
+    const MidiTrack& track(size_t i) const;
+
+    // Tick to seconds conversion built from the tempo events of all tracks
+    const TempoMap& tempo_map() const;
+
+    // The MThd division field as read: ppqn, or SMPTE (-fps in the high byte) if bit 15 is set
+    uint16_t division() const {
+        if (SMPTE)
+            return static_cast<uint16_t>(0x8000 | (static_cast<uint8_t>(-static_cast<int8_t>(fps)) << 8) | (sfps & 0xFF));
+        return ppqn;
+    }
+
+    // All tracks merged into one timeline. Built on first use and cached, safe to call
+    // from several threads.
+    const std::vector<MergedNote>& merged_notes() const;
+    const std::vector<MergedEvent>& merged_events() const;
+
+    // Same ordering, but merged on the fly while iterating - nothing is materialized
+    MidiMergeView<MergedNote> merged_notes_view() const { decode_all(); return MidiMergeView<MergedNote>(tracks); }
+    MidiMergeView<MergedEvent> merged_events_view() const { decode_all(); return MidiMergeView<MergedEvent>(tracks); }
 
 protected:
-    void parse_midi_file(std::ifstream& file);
+    // Decodes one MTrk chunk, pairing the notes as it goes. The Instrumented copy also
+    // fills in stats, the other one never touches it.
+    template <typename Policy, bool Instrumented>
+    static void decode_track(std::span<const std::byte> chunk, MidiTrack& track, const MidiParseOptions& options,
+                             std::vector<TempoChange>& tempo_changes, MidiNotePairer& pairer, MidiTrackStats* stats);
+
+    // The two decode_track copies of one policy, chosen once per file
+    using TrackDecoder = void (*)(std::span<const std::byte>, MidiTrack&, const MidiParseOptions&,
+                                  std::vector<TempoChange>&, MidiNotePairer&, MidiTrackStats*);
+    struct TrackDecoders {
+        TrackDecoder    plain;
+        TrackDecoder    instrumented;
+    };
+    template <typename Policy>
+    static TrackDecoders decoders_for();
+    template <typename Policy>
+    static TrackDecoders decoders_for(bool strict); // the strict twin of Policy if it isn't already
+    static TrackDecoders decoders_for(const MidiParseOptions& options); // from full_fidelity, storage and strict
+
+    void parse_midi_file(std::span<const std::byte> bytes, const MidiParseOptions& options, TrackDecoders decoders);
 
 private:
+    friend class MidiCache; // writes us out and builds us back from a cache file
+    friend class MidiWriter;
+    MidiFile() = default;
+
+    // Backing storage for the parsed views, at most one of these is in use
+    std::vector<std::byte>          owned_bytes;
+    std::optional<MidiFileMapping>  mapping;
+
+    // Where each MTrk chunk's events live (offset just past the chunk header)
+    struct TrackChunk {
+        size_t      offset = 0;
+        uint32_t    length = 0;
+    };
+    std::vector<TrackChunk> track_chunks;
+
+    // The MThd fields and the chunk index, nullopt if it isn't a midi file. A midi file
+    // with a short header or a chunk running past the end throws MidiParseError.
+    struct Header {
+        uint32_t                file_id = 0;
+        uint16_t                format = 0;
+        uint16_t                num_tracks = 0;
+        uint16_t                division = 0;
+        std::vector<TrackChunk> chunks;
+    };
+    static std::optional<Header> read_header(std::span<const std::byte> bytes);
+
+    // Only there when opened with MidiParseOptions::lazy - what it takes to decode a
+    // track later, and which ones are done
+    struct LazyTracks {
+        std::span<const std::byte>          bytes;
+        MidiParseOptions                    options;
+        TrackDecoders                       decoders;
+        std::unique_ptr<std::once_flag[]>   decoded;
+        std::once_flag                      tempo_once;
+    };
+    std::unique_ptr<LazyTracks> lazy;
+    void decode_lazy(size_t trk) const;
+    void decode_all() const; // the ones nobody asked for yet
+
+    // Lives on the heap so MidiFile stays movable (once_flag is not)
+    struct MergeCache {
+        std::once_flag              notes_once;
+        std::once_flag              events_once;
+        std::vector<MergedNote>     notes;
+        std::vector<MergedEvent>    events;
+    };
+    std::unique_ptr<MergeCache> merge_cache = std::make_unique<MergeCache>();
+
+    MidiDiagnostics*        diagnostics = nullptr; // from the parse options, for timing the merges
+
     uint32_t                file_id = 0;
     uint16_t                num_tracks = 0;
-    std::vector<MidiTrack>  tracks;
+    mutable std::vector<MidiTrack> tracks; // mutable: lazy tracks are filled in on first access
+    std::unique_ptr<MidiArena> arena;      // after tracks, so a move assignment lets go of the old tracks first
+    void make_tracks(size_t count, size_t arena_size); // empty tracks in a fresh arena
 
     // timing stuff
     bool                    SMPTE = false;
     uint16_t                fps = 0; // not in use if metrics
     uint16_t                sfps = 0;
     uint16_t                ppqn = 0; 
+    mutable TempoMap        tempo; // built on first use when lazy
 };
 
 
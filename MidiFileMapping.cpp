@@ -0,0 +1,128 @@
+
+#include "MidiFileMapping.hpp"
+#include <system_error>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+
+#ifdef _WIN32
+
+MidiFileMapping::MidiFileMapping(const std::string& path) {
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::system_error(GetLastError(), std::system_category(), "Could not open " + path);
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size)) {
+        DWORD err = GetLastError();
+        CloseHandle(file);
+        throw std::system_error(err, std::system_category(), "Could not stat " + path);
+    }
+
+    // Windows refuses to map an empty file - just leave the span empty
+    if (file_size.QuadPart > 0) {
+        map_handle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        DWORD err = GetLastError();
+        CloseHandle(file); // the mapping keeps its own reference to the file
+        if (!map_handle)
+            throw std::system_error(err, std::system_category(), "Could not map " + path);
+
+        data = static_cast<const std::byte*>(MapViewOfFile(map_handle, FILE_MAP_READ, 0, 0, 0));
+        if (!data) {
+            err = GetLastError();
+            CloseHandle(map_handle);
+            throw std::system_error(err, std::system_category(), "Could not map " + path);
+        }
+        size = static_cast<size_t>(file_size.QuadPart);
+    }
+    else
+        CloseHandle(file);
+}
+
+void MidiFileMapping::release() noexcept {
+    if (data)
+        UnmapViewOfFile(data);
+    if (map_handle)
+        CloseHandle(map_handle);
+    data = nullptr;
+    size = 0;
+    map_handle = nullptr;
+}
+
+#else
+
+MidiFileMapping::MidiFileMapping(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Could not open " + path);
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(), "Could not stat " + path);
+    }
+
+    // mmap of zero bytes is an error - an empty file simply gives an empty span
+    if (st.st_size > 0) {
+        void* p = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        int err = errno;
+        ::close(fd); // the mapping stays valid after the descriptor is closed
+        if (p == MAP_FAILED)
+            throw std::system_error(err, std::generic_category(), "Could not map " + path);
+
+        // The parser walks the file front to back
+        ::madvise(p, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+        data = static_cast<const std::byte*>(p);
+        size = static_cast<size_t>(st.st_size);
+    }
+    else
+        ::close(fd);
+}
+
+void MidiFileMapping::release() noexcept {
+    if (data)
+        ::munmap(const_cast<std::byte*>(data), size);
+    data = nullptr;
+    size = 0;
+}
+
+#endif
+
+
+MidiFileMapping::~MidiFileMapping() {
+    release();
+}
+
+MidiFileMapping::MidiFileMapping(MidiFileMapping&& other) noexcept
+    : data(std::exchange(other.data, nullptr))
+    , size(std::exchange(other.size, 0))
+#ifdef _WIN32
+    , map_handle(std::exchange(other.map_handle, nullptr))
+#endif
+{
+}
+
+MidiFileMapping& MidiFileMapping::operator=(MidiFileMapping&& other) noexcept {
+    if (this != &other) {
+        release();
+        data = std::exchange(other.data, nullptr);
+        size = std::exchange(other.size, 0);
+#ifdef _WIN32
+        map_handle = std::exchange(other.map_handle, nullptr);
+#endif
+    }
+    return *this;
+}
@@ -0,0 +1,36 @@
+#ifndef MIDIFILEMAPPING_HPP_
+#define MIDIFILEMAPPING_HPP_
+
+// Read only memory mapping of a whole file. Lets MidiFile decode straight out of the
+// page cache instead of pulling every byte through std::ifstream::get().
+//
+// The mapping is move only. Anything handed out by bytes() (and every string_view the
+// parser creates from it) is only valid while the mapping is alive.
+
+#include <cstddef>
+#include <span>
+#include <string>
+
+class MidiFileMapping {
+public:
+    explicit MidiFileMapping(const std::string& path); // throws std::system_error
+    ~MidiFileMapping();
+
+    MidiFileMapping(MidiFileMapping&& other) noexcept;
+    MidiFileMapping& operator=(MidiFileMapping&& other) noexcept;
+    MidiFileMapping(const MidiFileMapping&) = delete;
+    MidiFileMapping& operator=(const MidiFileMapping&) = delete;
+
+    std::span<const std::byte> bytes() const { return { data, size }; }
+
+private:
+    void release() noexcept;
+
+    const std::byte*    data = nullptr;
+    size_t              size = 0;
+#ifdef _WIN32
+    void*               map_handle = nullptr; // HANDLE from CreateFileMapping
+#endif
+};
+
+#endif // ! MIDIFILEMAPPING_HPP_
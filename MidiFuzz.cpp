@@ -0,0 +1,130 @@
+
+// Fuzz target for the parsers, libFuzzer style - AFL++ takes the same entry point. Not
+// part of the console project; build it from the parser sources only (not MidiBench.cpp)
+// with MIDI_FUZZ defined, which leaves the console's main() out of MidiFile.cpp:
+//
+//   SRCS="MidiFuzz.cpp MidiFile.cpp MidiFileMapping.cpp MidiStreamParser.cpp MidiWriter.cpp
+//         TempoMap.cpp MidiDiagnostics.cpp MidiScan.cpp"
+//
+//   clang++ -std=c++20 -g -O1 -fsanitize=fuzzer,address,undefined -DMIDI_FUZZ $SRCS -o midi_fuzz
+//   ./midi_fuzz -max_len=65536 corpus/           (organ.mid makes a good first seed)
+//
+//   afl-clang-fast++ -std=c++20 -O2 -fsanitize=fuzzer -DMIDI_FUZZ $SRCS -o midi_fuzz
+//   afl-fuzz -i seeds -o findings -- ./midi_fuzz
+//
+// Malformed input may throw MidiParseError and nothing else - anything else escaping,
+// a crash, a hang or a sanitizer report is a bug. On top of that a few invariants hold
+// between the ways of parsing the same bytes, see below.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <span>
+#include <vector>
+
+#include "MidiFile.hpp"
+#include "MidiStreamParser.hpp"
+#include "MidiWriter.hpp"
+
+namespace {
+
+    [[noreturn]] void invariant_broken() {
+        std::abort();
+    }
+
+    uint64_t event_count(const MidiFile& midi) {
+        uint64_t events = 0;
+        for (size_t i = 0; i < midi.track_count(); ++i)
+            events += midi.track(i).event_count();
+        return events;
+    }
+
+    // Whatever a lenient parse comes up with must be a file the writer can write and the
+    // parser read back
+    void write_and_read_back(const MidiFile& midi) {
+        std::vector<std::byte> out;
+        MidiWriter writer([&out](std::span<const std::byte> bytes) { out.insert(out.end(), bytes.begin(), bytes.end()); });
+        writer.write(midi);
+        try {
+            MidiFile again(out);
+            if (again.track_count() != midi.track_count())
+                invariant_broken();
+        }
+        catch (const MidiParseError&) {
+            invariant_broken();
+        }
+    }
+
+    // The push parser must cope with the bytes arriving in any pieces, and where it gets
+    // through a whole file read the same events as a lenient parse of it
+    void feed_in_pieces(std::span<const std::byte> bytes, bool lenient_ok, uint64_t lenient_events) {
+        MidiStreamParser stream;
+        uint64_t events = 0;
+        try {
+            for (size_t at = 0; at < bytes.size();) {
+                at += stream.feed(bytes.subspan(at, std::min<size_t>(7, bytes.size() - at)));
+                events += stream.poll_events().size();
+            }
+        }
+        catch (const MidiParseError&) {
+            return;
+        }
+        if (lenient_ok && stream.finished() && events != lenient_events)
+            invariant_broken();
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    std::span<const std::byte> bytes(reinterpret_cast<const std::byte*>(data), size);
+
+    // lenient - the one everything else is held up against
+    bool lenient_ok = false;
+    uint64_t lenient_events = 0;
+    try {
+        MidiFile midi(bytes);
+        lenient_ok = true;
+        lenient_events = event_count(midi);
+        write_and_read_back(midi);
+    }
+    catch (const MidiParseError&) {
+    }
+
+    // strict accepts less, and what it accepts reads the same as lenient
+    try {
+        MidiParseOptions strict;
+        strict.strict = true;
+        MidiFile midi(bytes, strict);
+        if (!lenient_ok || event_count(midi) != lenient_events)
+            invariant_broken();
+    }
+    catch (const MidiParseError&) {
+    }
+
+    // the other decoder copies: notes only into columns, and tracks decoded on demand
+    try {
+        MidiParseOptions notes;
+        notes.full_fidelity = false;
+        notes.storage = MidiEventStorage::Columns;
+        MidiFile midi(bytes, notes);
+    }
+    catch (const MidiParseError&) {
+    }
+    try {
+        MidiParseOptions lazy;
+        lazy.lazy = true;
+        MidiFile midi(bytes, lazy);
+        midi.tempo_map();
+        if (lenient_ok && event_count(midi) != lenient_events)
+            invariant_broken();
+    }
+    catch (const MidiParseError&) {
+    }
+    try {
+        MidiFile::scan(bytes);
+    }
+    catch (const MidiParseError&) {
+    }
+
+    feed_in_pieces(bytes, lenient_ok, lenient_events);
+    return 0;
+}
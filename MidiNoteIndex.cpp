@@ -0,0 +1,108 @@
+
+#include "MidiNoteIndex.hpp"
+#include <algorithm>
+
+
+MidiNoteIndex::MidiNoteIndex(const MidiFile& midi)
+    : all_notes(midi.merged_notes())
+{
+    starts.reserve(all_notes.size());
+    for (const auto& n : all_notes)
+        starts.push_back(n.note.start_time);
+
+    while (leaves < all_notes.size())
+        leaves <<= 1;
+
+    // Leaves hold the end of each note (a zero length note ends one tick after it
+    // starts), every other node the max of its two children. Unused leaves stay 0 and
+    // never match.
+    max_end.assign(2 * leaves, 0);
+    for (size_t i = 0; i < all_notes.size(); ++i) {
+        const MidiNote& n = all_notes[i].note;
+        max_end[leaves + i] = std::max(n.start_time + n.duration, n.start_time + 1);
+    }
+    for (size_t i = leaves; i-- > 1; )
+        max_end[i] = std::max(max_end[2 * i], max_end[2 * i + 1]);
+}
+
+uint32_t MidiNoteIndex::first_starting_at(uint32_t tick) const {
+    return static_cast<uint32_t>(std::lower_bound(starts.begin(), starts.end(), tick) - starts.begin());
+}
+
+void MidiNoteIndex::collect(size_t node, size_t lo, size_t hi, size_t count, uint32_t t0,
+                            const MidiNoteFilter& filter, std::vector<uint32_t>& out) const {
+    // nothing in here starts early enough, or everything in here is over by t0
+    if (lo >= count || max_end[node] <= t0)
+        return;
+    if (hi - lo == 1) {
+        if (filter.accepts(all_notes[lo]))
+            out.push_back(static_cast<uint32_t>(lo));
+        return;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    collect(2 * node, lo, mid, count, t0, filter, out);
+    collect(2 * node + 1, mid, hi, count, t0, filter, out);
+}
+
+void MidiNoteIndex::query(uint32_t t0, uint32_t t1, std::vector<uint32_t>& out, const MidiNoteFilter& filter) const {
+    out.clear();
+    if (t1 <= t0 || all_notes.empty())
+        return;
+    // only the notes starting before t1 can reach into the window
+    collect(1, 0, leaves, first_starting_at(t1), t0, filter, out);
+}
+
+std::vector<MergedNote> MidiNoteIndex::notes_in(uint32_t t0, uint32_t t1, const MidiNoteFilter& filter) const {
+    std::vector<uint32_t> found;
+    query(t0, t1, found, filter);
+    std::vector<MergedNote> out;
+    out.reserve(found.size());
+    for (uint32_t i : found)
+        out.push_back(all_notes[i]);
+    return out;
+}
+
+
+MidiNoteCursor::MidiNoteCursor(const MidiNoteIndex& index, MidiNoteFilter filter)
+    : index(&index)
+    , filter(std::move(filter))
+{
+}
+
+void MidiNoteCursor::advance(uint32_t t0, uint32_t t1) {
+    entered.clear();
+    left.clear();
+
+    // A jump back in time - start over from the index, whatever was sounding stops
+    if (t0 < window_start || t1 < window_end) {
+        left.swap(active);
+        index->query(t0, t1, active, filter);
+        entered.assign(active.begin(), active.end());
+        next = index->first_starting_at(t1);
+        window_start = t0;
+        window_end = t1;
+        return;
+    }
+
+    // Out with the notes that ended before the new window
+    auto keep = std::remove_if(active.begin(), active.end(), [&](uint32_t i) {
+        if (index->end(i) > t0)
+            return false;
+        left.push_back(i);
+        return true;
+    });
+    active.erase(keep, active.end());
+
+    // In with the ones that started since. Anything that started and ended in the gap
+    // between the two windows was never sounding in either.
+    auto notes = index->notes();
+    for (; next < notes.size() && notes[next].note.start_time < t1; ++next) {
+        if (index->end(next) > t0 && filter.accepts(notes[next])) {
+            active.push_back(next);
+            entered.push_back(next);
+        }
+    }
+
+    window_start = t0;
+    window_end = t1;
+}
@@ -0,0 +1,94 @@
+#ifndef MIDINOTEINDEX_HPP_
+#define MIDINOTEINDEX_HPP_
+
+// "Which notes sound between t0 and t1" without scanning every track.
+//
+// The notes of all tracks sit in one array sorted by start time. On top of it is an
+// implicit binary tree where each node knows the latest end of the notes below it. A
+// query binary searches for the last note starting before t1 and then walks down the
+// tree only into subtrees that still have a note ending after t0 - O(log n) to get going
+// and O(log n) per note found, instead of O(n).
+//
+// For playback style windows that only move forward MidiNoteCursor keeps the sounding
+// notes from the last window and only looks at what started or ended since.
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "MidiFile.hpp"
+
+// Which notes a query returns. The default takes everything.
+struct MidiNoteFilter {
+    std::vector<bool>   tracks;             // tracks[i] false leaves out track i, empty = all tracks
+    uint16_t            channels = 0xFFFF;  // one bit per channel
+    uint8_t             low_note = 0;       // pitch range, inclusive
+    uint8_t             high_note = 127;
+
+    bool accepts(const MergedNote& n) const {
+        return (tracks.empty() || (n.track < tracks.size() && tracks[n.track]))
+            && (channels >> (n.note.channel & 0x0F) & 1)
+            && n.note.note >= low_note && n.note.note <= high_note;
+    }
+};
+
+class MidiNoteIndex {
+public:
+    // Built once, midi isn't referenced afterwards
+    explicit MidiNoteIndex(const MidiFile& midi);
+
+    // All notes in start order (ties by track) - query results index into this
+    std::span<const MergedNote> notes() const { return all_notes; }
+
+    // Indices of the notes sounding somewhere in [t0, t1), in start order. A zero length
+    // note counts as sounding at its start tick. out is cleared first.
+    void query(uint32_t t0, uint32_t t1, std::vector<uint32_t>& out, const MidiNoteFilter& filter = {}) const;
+
+    // Same, copied out
+    std::vector<MergedNote> notes_in(uint32_t t0, uint32_t t1, const MidiNoteFilter& filter = {}) const;
+
+    // First note starting at or after tick
+    uint32_t first_starting_at(uint32_t tick) const;
+
+    // Where a note stops counting as sounding
+    uint32_t end(uint32_t i) const { return max_end[leaves + i]; }
+
+private:
+    void collect(size_t node, size_t lo, size_t hi, size_t count, uint32_t t0,
+                 const MidiNoteFilter& filter, std::vector<uint32_t>& out) const;
+
+    std::vector<MergedNote> all_notes;
+    std::vector<uint32_t>   starts;     // all_notes[i].note.start_time, for the binary search
+    std::vector<uint32_t>   max_end;    // the tree: node i has children 2i and 2i+1, leaves from index leaves
+    size_t                  leaves = 1;
+};
+
+// Sounding notes for a window that moves forward: after each advance() the previous
+// window's result is updated with what started and ended in between. Moving backwards
+// falls back to a fresh query.
+class MidiNoteCursor {
+public:
+    // index must outlive the cursor
+    explicit MidiNoteCursor(const MidiNoteIndex& index, MidiNoteFilter filter = {});
+
+    // Moves the window to [t0, t1)
+    void advance(uint32_t t0, uint32_t t1);
+
+    // Notes sounding in the current window, in start order (indices into index.notes())
+    std::span<const uint32_t> sounding() const { return active; }
+    // What changed with the last advance()
+    std::span<const uint32_t> started() const { return entered; }
+    std::span<const uint32_t> stopped() const { return left; }
+
+private:
+    const MidiNoteIndex*    index;
+    MidiNoteFilter          filter;
+    uint32_t                window_start = 0;
+    uint32_t                window_end = 0;
+    uint32_t                next = 0;   // first note not yet looked at (starts at or after window_end)
+    std::vector<uint32_t>   active;
+    std::vector<uint32_t>   entered;
+    std::vector<uint32_t>   left;
+};
+
+#endif // ! MIDINOTEINDEX_HPP_
@@ -0,0 +1,124 @@
+#ifndef MIDINOTEPAIRER_HPP_
+#define MIDINOTEPAIRER_HPP_
+
+// Turns note on/off events into MidiNotes while a track is being decoded.
+//
+// Every (channel, pitch) has a slot in a fixed 16x128 table holding a FIFO of the notes
+// still sounding on it, so the same pitch on two channels never collides and a pitch
+// struck again before it was released gives two notes - the first note off ends the
+// oldest one. The FIFO nodes come out of a pool that only grows to the largest number of
+// notes ever held at once and is reused from track to track, so once warmed up pairing
+// allocates nothing but the notes themselves.
+//
+// A note is appended to the output when it starts and its duration is filled in when it
+// ends, so the notes come out in start order with no sorting.
+
+#include <array>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+#include "MidiFile.hpp"
+
+class MidiNotePairer {
+public:
+    MidiNotePairer() { slots.fill({ none, none }); }
+
+    // Notes of the next track go to notes
+    void start_track(std::pmr::vector<MidiNote>& notes) {
+        out = &notes;
+    }
+
+    void note_on(uint8_t channel, uint8_t note, uint8_t velocity, uint32_t tick) {
+        uint32_t node = free_head;
+        if (node != none)
+            free_head = pool[node].next;
+        else {
+            node = static_cast<uint32_t>(pool.size());
+            pool.push_back({});
+        }
+        pool[node] = { static_cast<uint32_t>(out->size()), none };
+        out->push_back({ note, velocity, channel, tick, 0 });
+
+        Slot& s = slot(channel, note);
+        if (s.tail == none)
+            s.head = node;
+        else
+            pool[s.tail].next = node;
+        s.tail = node;
+        ++sounding;
+    }
+
+    // A note off with nothing sounding on its slot is ignored
+    void note_off(uint8_t channel, uint8_t note, uint32_t tick) {
+        Slot& s = slot(channel, note);
+        uint32_t node = s.head;
+        if (node == none)
+            return;
+        s.head = pool[node].next;
+        if (s.head == none)
+            s.tail = none;
+
+        MidiNote& n = (*out)[pool[node].note];
+        n.duration = tick - n.start_time;
+
+        pool[node].next = free_head;
+        free_head = node;
+        --sounding;
+    }
+
+    // Deals with the notes still sounding at the end of the track (end_tick) and gets
+    // the table ready for the next one
+    void finish_track(uint32_t end_tick, MidiDanglingNotes policy) {
+        if (sounding) {
+            bool dropped = false;
+            for (Slot& s : slots) {
+                for (uint32_t node = s.head; node != none; node = pool[node].next) {
+                    MidiNote& n = (*out)[pool[node].note];
+                    if (policy == MidiDanglingNotes::EndOfTrack)
+                        n.duration = end_tick - n.start_time;
+                    else {
+                        n.velocity = 0; // a real note on never has velocity 0 - marks it for removal
+                        dropped = true;
+                    }
+                }
+                s = { none, none };
+            }
+            if (dropped)
+                std::erase_if(*out, [](const MidiNote& n) { return n.velocity == 0; });
+
+            // hand the whole pool back to the free list
+            free_head = none;
+            for (uint32_t node = static_cast<uint32_t>(pool.size()); node-- > 0; ) {
+                pool[node].next = free_head;
+                free_head = node;
+            }
+            sounding = 0;
+        }
+        out = nullptr;
+    }
+
+private:
+    static constexpr uint32_t none = UINT32_MAX;
+
+    struct Slot {
+        uint32_t head;
+        uint32_t tail;
+    };
+    struct Node {
+        uint32_t note; // index into the output
+        uint32_t next;
+    };
+
+    Slot& slot(uint8_t channel, uint8_t note) {
+        return slots[((channel & 0x0F) << 7) | (note & 0x7F)];
+    }
+
+    std::array<Slot, 16 * 128>  slots;
+    std::vector<Node>           pool;
+    uint32_t                    free_head = none;
+    uint32_t                    sounding = 0;
+    std::pmr::vector<MidiNote>* out = nullptr;
+};
+
+#endif // ! MIDINOTEPAIRER_HPP_
@@ -0,0 +1,189 @@
+
+#include "MidiPlayer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+#include <system_error>
+#include <cerrno>
+
+
+namespace {
+    int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Sleep while there is plenty of time left, spin the last stretch - sleep_for alone
+    // easily oversleeps by a millisecond. Sleeps are cut into slices so a stop is seen
+    // within one, not at the next deadline. False if stopped before the deadline.
+    constexpr int64_t max_sleep_ns = 5000000;
+
+    bool wait_until(int64_t deadline_ns, int64_t spin_ns, const std::atomic<bool>& stop) {
+        for (;;) {
+            if (stop.load(std::memory_order_relaxed))
+                return false;
+            int64_t left = deadline_ns - now_ns();
+            if (left <= 0)
+                return true;
+            if (left > spin_ns)
+                std::this_thread::sleep_for(std::chrono::nanoseconds(std::min(left - spin_ns, max_sleep_ns)));
+            else
+                std::this_thread::yield();
+        }
+    }
+
+    const char* event_name(MidiEvent::EventType type) {
+        switch (type) {
+        case MidiEvent::EventType::NoteOn:          return "NoteOn";
+        case MidiEvent::EventType::NoteOff:         return "NoteOff";
+        case MidiEvent::EventType::AfterTouch:      return "AfterTouch";
+        case MidiEvent::EventType::ControlChange:   return "ControlChange";
+        case MidiEvent::EventType::ProgramChange:   return "ProgramChange";
+        case MidiEvent::EventType::ChannelPressure: return "ChannelPressure";
+        case MidiEvent::EventType::PitchBend:       return "PitchBend";
+        case MidiEvent::EventType::SysEx:           return "SysEx";
+        case MidiEvent::EventType::Meta:            return "Meta";
+        case MidiEvent::EventType::Tempo:           return "Tempo";
+        case MidiEvent::EventType::TimeSignature:   return "TimeSignature";
+        case MidiEvent::EventType::KeySignature:    return "KeySignature";
+        default:                                    return "Other";
+        }
+    }
+}
+
+
+int64_t LatencyHistogram::percentile_ns(double p) const {
+    if (!total)
+        return 0;
+    uint64_t wanted = static_cast<uint64_t>(p / 100.0 * total);
+    if (wanted >= total)
+        wanted = total - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen > wanted)
+            return i == buckets.size() - 1 ? worst_ns : int64_t(i + 1) * 1000;
+    }
+    return worst_ns;
+}
+
+void LatencyHistogram::print(std::ostream& os, const char* name) const {
+    auto flgs = os.flags();
+    os << name << ": " << total << " events, mean " << std::fixed << std::setprecision(1) << mean_ns() / 1000.0
+       << " us, p50 " << percentile_ns(50) / 1000 << " us, p99 " << percentile_ns(99) / 1000
+       << " us, p99.9 " << percentile_ns(99.9) / 1000 << " us, max " << max_ns() / 1000.0 << " us\n";
+    os.flags(flgs);
+}
+
+
+MidiLogSink::MidiLogSink(const std::string& path)
+    : file(std::fopen(path.c_str(), "w"), [](std::FILE* f) { if (f) std::fclose(f); })
+{
+    if (!file)
+        throw std::system_error(errno, std::generic_category(), "Could not open " + path);
+}
+
+void MidiLogSink::operator()(const PlaybackEvent& e) const {
+    const MidiEvent& ev = e.event.event;
+    std::fprintf(file.get(), "%.6f\t%+.1f\t%u\t%s\t%u\t%u\t%u\n",
+        e.seconds, (e.dispatched_ns - e.deadline_ns) / 1000.0, unsigned(e.event.track),
+        event_name(ev.event), unsigned(ev.channel), unsigned(ev.note), unsigned(ev.velocity));
+}
+
+
+MidiPlayer::MidiPlayer(const MidiFile& midi, Sink sink, const MidiPlayerOptions& options)
+    : sink(std::move(sink))
+    , options(options)
+    , ring(options.ring_capacity)
+{
+    const auto& events = midi.merged_events();
+
+    std::vector<uint32_t> ticks;
+    ticks.reserve(events.size());
+    schedule.reserve(events.size());
+    for (const auto& e : events) {
+        bool is_note = e.event.event == MidiEvent::EventType::NoteOn || e.event.event == MidiEvent::EventType::NoteOff;
+        if (e.event.event == MidiEvent::EventType::Other || (options.notes_only && !is_note))
+            continue;
+        schedule.push_back({ e, 0.0 });
+        ticks.push_back(e.time);
+    }
+
+    std::vector<double> seconds(ticks.size());
+    midi.tempo_map().seconds(ticks, seconds);
+    for (size_t i = 0; i < schedule.size(); ++i)
+        schedule[i].seconds = seconds[i];
+}
+
+MidiPlayer::~MidiPlayer() {
+    stop();
+    wait();
+}
+
+void MidiPlayer::start() {
+    if (running.exchange(true))
+        return;
+    stop_requested = false;
+    dispatch_done = false;
+
+    // small lead so the threads are up before the first deadline
+    int64_t start_ns = now_ns() + 2000000;
+    consumer = std::thread(&MidiPlayer::consume_loop, this);
+    dispatcher = std::thread(&MidiPlayer::dispatch_loop, this, start_ns);
+}
+
+void MidiPlayer::stop() {
+    stop_requested = true;
+}
+
+void MidiPlayer::wait() {
+    if (dispatcher.joinable())
+        dispatcher.join();
+    if (consumer.joinable())
+        consumer.join();
+    running = false;
+}
+
+void MidiPlayer::dispatch_loop(int64_t start_ns) {
+    double ns_per_second = 1e9 / (options.speed > 0.0 ? options.speed : 1.0);
+
+    for (const auto& s : schedule) {
+        int64_t deadline = start_ns + static_cast<int64_t>(s.seconds * ns_per_second);
+        if (!wait_until(deadline, options.spin_ns, stop_requested))
+            break;
+
+        PlaybackEvent pe{ s.event, s.seconds, deadline, now_ns() };
+        jitter_hist.record(pe.dispatched_ns - deadline);
+
+        // a full ring means the sink can't keep up - wait for room rather than drop a note off
+        while (!ring.push(pe)) {
+            if (stop_requested.load(std::memory_order_relaxed))
+                break;
+            std::this_thread::yield();
+        }
+        wakeups.fetch_add(1, std::memory_order_release);
+        wakeups.notify_one();
+    }
+
+    dispatch_done = true;
+    wakeups.fetch_add(1, std::memory_order_release);
+    wakeups.notify_one();
+}
+
+void MidiPlayer::consume_loop() {
+    PlaybackEvent pe;
+    for (;;) {
+        uint32_t seen = wakeups.load(std::memory_order_acquire);
+        bool done = dispatch_done.load(std::memory_order_acquire);
+
+        while (ring.pop(pe)) {
+            latency_hist.record(now_ns() - pe.deadline_ns);
+            if (sink)
+                sink(pe);
+        }
+        if (done)
+            return;
+        wakeups.wait(seen, std::memory_order_acquire);
+    }
+}
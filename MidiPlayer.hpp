@@ -0,0 +1,133 @@
+#ifndef MIDIPLAYER_HPP_
+#define MIDIPLAYER_HPP_
+
+// The "very simple playback sequencer" from the MidiFile header. Not to a midi device but
+// to a callback or a time logged file.
+//
+// A dispatch thread walks the merged, tempo converted events and hands each one over at
+// its deadline (sleeping until close, then spinning the last stretch). Events travel to a
+// consumer thread through a lock free ring and the consumer calls the sink. Everything is
+// allocated before playback starts - the hot path only copies events into the ring.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MidiFile.hpp"
+#include "SpscRing.hpp"
+
+// An event as handed to the sink
+struct PlaybackEvent {
+    MergedEvent event;
+    double      seconds = 0.0;      // scheduled time from the start of the song
+    int64_t     deadline_ns = 0;    // steady clock time it was due
+    int64_t     dispatched_ns = 0;  // steady clock time the dispatcher let go of it
+};
+
+// Fixed 1 microsecond buckets up to 10 ms plus one for everything later. Recording is a
+// single increment. Only the owning thread records - read it once playback has stopped.
+class LatencyHistogram {
+public:
+    static constexpr size_t num_buckets = 10001;
+
+    LatencyHistogram() : buckets(num_buckets, 0) {}
+
+    void record(int64_t ns) {
+        if (ns < 0)
+            ns = 0; // early counts as on time
+        size_t us = static_cast<size_t>(ns / 1000);
+        ++buckets[us < num_buckets - 1 ? us : num_buckets - 1];
+        ++total;
+        sum_ns += ns;
+        if (ns > worst_ns)
+            worst_ns = ns;
+    }
+
+    uint64_t count() const { return total; }
+    int64_t max_ns() const { return worst_ns; }
+    double mean_ns() const { return total ? double(sum_ns) / total : 0.0; }
+    // Upper edge of the bucket holding the p'th percentile (p in 0-100), in nanoseconds
+    int64_t percentile_ns(double p) const;
+    const std::vector<uint64_t>& bucket_counts() const { return buckets; }
+
+    void print(std::ostream& os, const char* name) const;
+
+private:
+    std::vector<uint64_t>   buckets;
+    uint64_t                total = 0;
+    int64_t                 sum_ns = 0;
+    int64_t                 worst_ns = 0;
+};
+
+struct MidiPlayerOptions {
+    double      speed = 1.0;            // 2.0 plays twice as fast
+    size_t      ring_capacity = 4096;
+    int64_t     spin_ns = 200000;       // busy wait this close to a deadline instead of sleeping
+    bool        notes_only = false;     // only dispatch note on/off
+};
+
+// Writes one line per event: seconds, lateness in microseconds, track, type, channel and
+// data bytes. The file is shared between copies of the sink.
+class MidiLogSink {
+public:
+    explicit MidiLogSink(const std::string& path); // throws std::system_error
+    void operator()(const PlaybackEvent& e) const;
+
+private:
+    std::shared_ptr<std::FILE> file;
+};
+
+class MidiPlayer {
+public:
+    using Sink = std::function<void(const PlaybackEvent&)>;
+
+    // Schedules all events of midi up front. midi must outlive the player.
+    MidiPlayer(const MidiFile& midi, Sink sink, const MidiPlayerOptions& options = {});
+    ~MidiPlayer();
+
+    MidiPlayer(const MidiPlayer&) = delete;
+    MidiPlayer& operator=(const MidiPlayer&) = delete;
+
+    void start();
+    void stop();    // stops early (within a few ms), events already in the ring still reach the sink
+    void wait();    // blocks until everything has been played (or stopped)
+    bool playing() const { return running; }
+
+    size_t num_scheduled() const { return schedule.size(); }
+
+    // Dispatch time minus deadline, and sink call time minus deadline
+    const LatencyHistogram& jitter() const { return jitter_hist; }
+    const LatencyHistogram& latency() const { return latency_hist; }
+
+private:
+    struct Scheduled {
+        MergedEvent event;
+        double      seconds;
+    };
+
+    void dispatch_loop(int64_t start_ns);
+    void consume_loop();
+
+    Sink                    sink;
+    MidiPlayerOptions       options;
+    std::vector<Scheduled>  schedule;
+    SpscRing<PlaybackEvent> ring;
+
+    std::thread             dispatcher;
+    std::thread             consumer;
+    std::atomic<bool>       running{ false };
+    std::atomic<bool>       stop_requested{ false };
+    std::atomic<bool>       dispatch_done{ false };
+    std::atomic<uint32_t>   wakeups{ 0 };   // bumped on every push so the consumer can sleep on it
+
+    LatencyHistogram        jitter_hist;
+    LatencyHistogram        latency_hist;
+};
+
+#endif // ! MIDIPLAYER_HPP_
@@ -0,0 +1,98 @@
+
+#include "MidiScan.hpp"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define MIDI_SCAN_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// gcc and clang only let us use AVX2 intrinsics in a function marked for it, msvc
+// always does
+#if defined(MIDI_SCAN_X86) && (defined(__GNUC__) || defined(__clang__))
+#define MIDI_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define MIDI_TARGET_AVX2
+#endif
+
+
+namespace {
+
+    // Eight bytes at a time: keep the top bits, then one multiply moves bit 7 of byte i
+    // to bit 56 + i. Assumes a little endian load like every target we build for.
+    [[maybe_unused]] uint64_t high_bits_scalar(const uint8_t* p) {
+        uint64_t mask = 0;
+        for (size_t i = 0; i < midi_scan_block; i += 8) {
+            uint64_t x;
+            std::memcpy(&x, p + i, sizeof(x));
+            x = (x & 0x8080808080808080ull) >> 7;
+            mask |= ((x * 0x0102040810204080ull) >> 56) << i;
+        }
+        return mask;
+    }
+
+#ifdef MIDI_SCAN_X86
+    // movemask is exactly "the top bit of every byte"
+    uint64_t high_bits_sse2(const uint8_t* p) {
+        uint64_t mask = 0;
+        for (size_t i = 0; i < midi_scan_block; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            mask |= uint64_t(uint32_t(_mm_movemask_epi8(v)) & 0xFFFF) << i;
+        }
+        return mask;
+    }
+
+    MIDI_TARGET_AVX2 uint64_t high_bits_avx2(const uint8_t* p) {
+        __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+        return uint64_t(uint32_t(_mm256_movemask_epi8(lo))) | (uint64_t(uint32_t(_mm256_movemask_epi8(hi))) << 32);
+    }
+
+    bool cpu_has_avx2() {
+#ifdef _MSC_VER
+        // AVX2 flag, and the OS must save the ymm registers (OSXSAVE + XCR0)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+            return false;
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#endif
+
+    struct Kernel {
+        uint64_t    (*high_bits)(const uint8_t*);
+        const char* name;
+    };
+
+    Kernel pick_kernel() {
+#ifdef MIDI_SCAN_X86
+        if (cpu_has_avx2())
+            return { high_bits_avx2, "avx2" };
+        return { high_bits_sse2, "sse2" }; // every x86-64 has SSE2
+#else
+        return { high_bits_scalar, "scalar" };
+#endif
+    }
+
+    const Kernel kernel = pick_kernel();
+}
+
+uint64_t midi_high_bits(const uint8_t* p) {
+    return kernel.high_bits(p);
+}
+
+const char* midi_scan_kernel() {
+    return kernel.name;
+}
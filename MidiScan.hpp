@@ -0,0 +1,43 @@
+#ifndef MIDISCAN_HPP_
+#define MIDISCAN_HPP_
+
+// Byte classification for the track decoder. In a track chunk the top bit of a byte
+// says almost everything about it: set on a status byte and on every VLQ byte but the
+// last, clear on data bytes. midi_high_bits() gathers that bit for a whole block at once
+// so the decoder can find delta time terminators and status bytes with a shift and a
+// count trailing zeros instead of testing byte by byte.
+//
+// The kernel is picked once at startup from what the cpu supports: AVX2, SSE2 or a
+// plain 64 bit (SWAR) version for everything else.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Bytes looked at by one midi_high_bits() call
+constexpr size_t midi_scan_block = 64;
+
+// Bit i of the result is the top bit of p[i]. Reads exactly midi_scan_block bytes.
+uint64_t midi_high_bits(const uint8_t* p);
+
+// "avx2", "sse2" or "scalar"
+const char* midi_scan_kernel();
+
+// Number of data bytes after a status byte. midi_variable_length for sysex and meta
+// (a length prefixed payload follows) and for everything that can't start an event in
+// a file - data bytes, and system common/real time messages.
+constexpr uint8_t midi_variable_length = 0xFF;
+
+constexpr std::array<uint8_t, 256> midi_data_length = [] {
+    std::array<uint8_t, 256> t{};
+    for (size_t s = 0; s < t.size(); ++s) {
+        switch (s & 0xF0) {
+        case 0x80: case 0x90: case 0xA0: case 0xB0: case 0xE0: t[s] = 2; break;
+        case 0xC0: case 0xD0: t[s] = 1; break;
+        default: t[s] = midi_variable_length; break;
+        }
+    }
+    return t;
+}();
+
+#endif // ! MIDISCAN_HPP_
@@ -0,0 +1,315 @@
+
+#include "MidiStreamParser.hpp"
+#include <algorithm>
+#include <cstring>
+
+
+namespace {
+    constexpr uint32_t MThd = 0x4D546864;
+    constexpr uint32_t MTrk = 0x4D54726B;
+}
+
+
+MidiStreamParser::MidiStreamParser(const Limits& limits, bool strict)
+    : limits(limits)
+    , strict(strict)
+{
+    events.reserve(limits.max_events);
+}
+
+bool MidiStreamParser::queue_full() const {
+    return events.size() >= limits.max_events || arena.size() >= limits.max_payload_bytes;
+}
+
+void MidiStreamParser::fail(MidiErrc code, const char* why) {
+    state = State::Failed;
+    throw MidiParseError(code, why, total_consumed + pos);
+}
+
+std::span<const MergedEvent> MidiStreamParser::poll_events() {
+    polled = true;
+    return events;
+}
+
+std::span<const std::byte> MidiStreamParser::payload(const MergedEvent& e) const {
+    if (e.event.event != MidiEvent::EventType::SysEx && e.event.event != MidiEvent::EventType::Meta)
+        return {};
+    uint32_t length;
+    std::memcpy(&length, arena.data() + e.event.payload, sizeof(length));
+    return { arena.data() + e.event.payload + sizeof(length), length };
+}
+
+void MidiStreamParser::emit(const MidiEvent& e) {
+    events.push_back({ e, tick, track });
+}
+
+// Everything but metas and sysex goes straight to the data bytes
+void MidiStreamParser::begin_event_data(uint8_t s) {
+    status = s;
+    if (s < 0xF0) {
+        prev_status = s;
+        state = State::Data1;
+    }
+    else if (s == 0xF0 || s == 0xF7) {
+        prev_status = 0;
+        meta_type = s;
+        state = State::Length;
+    }
+    else {
+        // Other system messages have no place in a file. Like MidiFile we read them as
+        // FF metas (type, length, data) unless strict.
+        if (strict && s != 0xFF)
+            fail(MidiErrc::SystemMessage, "System message in a track");
+        prev_status = 0;
+        state = State::MetaType;
+    }
+}
+
+void MidiStreamParser::finish_payload() {
+    const auto* p = reinterpret_cast<const uint8_t*>(partial.data());
+    size_t length = partial.size();
+
+    auto to_arena = [this]() {
+        uint32_t offset = static_cast<uint32_t>(arena.size());
+        uint32_t length = static_cast<uint32_t>(partial.size());
+        arena.resize(offset + sizeof(length) + length);
+        std::memcpy(arena.data() + offset, &length, sizeof(length));
+        if (length) // an empty payload has no data() to copy from
+            std::memcpy(arena.data() + offset + sizeof(length), partial.data(), length);
+        return offset;
+    };
+
+    state = State::Delta;
+    if (status == 0xF0 || status == 0xF7) {
+        emit({ MidiEvent::EventType::SysEx, delta, 0, 0, 0, meta_type, to_arena() });
+        return;
+    }
+
+    // Same representation as MidiFile - the small ones live in the event itself
+    if (meta_type == 0x51 && length >= 3)
+        emit({ MidiEvent::EventType::Tempo, delta, 0, 0, 0, meta_type, uint32_t((p[0] << 16) | (p[1] << 8) | p[2]) });
+    else if (meta_type == 0x58 && length >= 4)
+        emit({ MidiEvent::EventType::TimeSignature, delta, 0, 0, 0, meta_type,
+               (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3] });
+    else if (meta_type == 0x59 && length >= 2)
+        emit({ MidiEvent::EventType::KeySignature, delta, 0, 0, 0, meta_type, uint32_t((p[0] << 8) | p[1]) });
+    else
+        emit({ MidiEvent::EventType::Meta, delta, 0, 0, 0, meta_type, to_arena() });
+
+    if (meta_type == 0x2F) { // end of track - whatever is left of the chunk is ignored
+        in_track = false;
+        ++finished_tracks;
+        ++track;
+        state = chunk_left ? State::SkipChunk : State::ChunkId;
+    }
+}
+
+// A track chunk must end right after a complete event
+void MidiStreamParser::check_track_end() {
+    if (!in_track || chunk_left)
+        return;
+    if (state != State::Delta || acc_bytes)
+        fail(MidiErrc::Truncated, "Track chunk ends in the middle of an event");
+    // no end of track meta - be lenient and call it done
+    in_track = false;
+    ++finished_tracks;
+    ++track;
+    state = State::ChunkId;
+}
+
+size_t MidiStreamParser::feed(std::span<const std::byte> bytes) {
+
+    if (state == State::Failed)
+        throw MidiParseError("Stream parser already failed");
+
+    if (polled) {
+        events.clear();
+        arena.clear();
+        polled = false;
+    }
+
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(bytes.data());
+    pos = 0;
+    size_t size = bytes.size();
+
+    while (pos < size && !queue_full()) {
+
+        // The two states that can take whole runs of bytes at once
+        if (state == State::SkipChunk) {
+            size_t n = std::min<size_t>(size - pos, chunk_left);
+            pos += n;
+            chunk_left -= static_cast<uint32_t>(n);
+            if (!chunk_left)
+                state = State::ChunkId;
+            continue;
+        }
+        if (state == State::Payload) {
+            size_t n = std::min<size_t>({ size - pos, payload_left, chunk_left });
+            size_t keep = std::min(n, limits.max_payload - std::min(limits.max_payload, partial.size()));
+            partial.insert(partial.end(), bytes.begin() + pos, bytes.begin() + pos + keep);
+            pos += n;
+            payload_left -= static_cast<uint32_t>(n);
+            chunk_left -= static_cast<uint32_t>(n);
+            if (!payload_left)
+                finish_payload();
+            check_track_end();
+            continue;
+        }
+
+        uint8_t b = data[pos++];
+        if (in_track)
+            --chunk_left;
+
+        switch (state) {
+        case State::HeaderId:
+            acc = (acc << 8) | b;
+            if (++acc_bytes == 4) {
+                if (acc != MThd)
+                    fail(MidiErrc::NotMidi, "Not a midi file (no MThd)");
+                acc = 0;
+                acc_bytes = 0;
+                state = State::HeaderLength;
+            }
+            break;
+
+        case State::HeaderLength:
+            acc = (acc << 8) | b;
+            if (++acc_bytes == 4) {
+                if (acc < 6)
+                    fail(MidiErrc::BadHeader, "Midi header too short");
+                header_left = acc;
+                acc = 0;
+                acc_bytes = 0;
+                state = State::HeaderBody;
+            }
+            break;
+
+        case State::HeaderBody:
+            // format, number of tracks and division - anything after those is ignored
+            if (acc_bytes < 6) {
+                acc = (acc << 8) | b;
+                ++acc_bytes;
+                if (acc_bytes == 2)
+                    file_format = static_cast<uint16_t>(acc);
+                else if (acc_bytes == 4)
+                    declared_tracks = static_cast<uint16_t>(acc);
+                else if (acc_bytes == 6)
+                    time_division = static_cast<uint16_t>(acc);
+                if (acc_bytes % 2 == 0)
+                    acc = 0;
+            }
+            if (--header_left == 0) {
+                acc = 0;
+                acc_bytes = 0;
+                state = State::ChunkId;
+            }
+            break;
+
+        case State::ChunkId:
+            acc = (acc << 8) | b;
+            if (++acc_bytes == 4) {
+                chunk_id = acc;
+                acc = 0;
+                acc_bytes = 0;
+                state = State::ChunkLength;
+            }
+            break;
+
+        case State::ChunkLength:
+            acc = (acc << 8) | b;
+            if (++acc_bytes == 4) {
+                chunk_left = acc;
+                acc = 0;
+                acc_bytes = 0;
+                if (chunk_id != MTrk)
+                    state = chunk_left ? State::SkipChunk : State::ChunkId; // alien chunk
+                else if (!chunk_left) {
+                    ++finished_tracks;
+                    ++track;
+                    state = State::ChunkId;
+                }
+                else {
+                    in_track = true;
+                    tick = 0;
+                    prev_status = 0;
+                    state = State::Delta;
+                }
+            }
+            break;
+
+        case State::Delta:
+            acc = (acc << 7) | (b & 0x7F);
+            if (++acc_bytes > 4)
+                fail(MidiErrc::LengthTooLong, "Delta time longer than 4 bytes");
+            if (!(b & 0x80)) {
+                delta = acc;
+                tick += delta;
+                acc = 0;
+                acc_bytes = 0;
+                state = State::Status;
+            }
+            break;
+
+        case State::Status:
+            if (b >= 0x80) {
+                begin_event_data(b);
+                break;
+            }
+            // running status - this byte is already the first data byte
+            if (!prev_status) {
+                if (strict)
+                    fail(MidiErrc::MissingStatus, "Running status without a previous status byte");
+                // nothing to run on - like MidiFile, read the byte as the next delta time
+                // (a whole one, it is below 0x80)
+                delta += b;
+                tick += b;
+                break;
+            }
+            status = prev_status;
+            [[fallthrough]];
+
+        case State::Data1:
+            data1 = b;
+            if ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) {
+                emit({ midi_event_type(status, b, 0), delta, b, 0, static_cast<uint8_t>(status & 0x0F) });
+                state = State::Delta;
+            }
+            else
+                state = State::Data2;
+            break;
+
+        case State::Data2:
+            emit({ midi_event_type(status, data1, b), delta, data1, b, static_cast<uint8_t>(status & 0x0F) });
+            state = State::Delta;
+            break;
+
+        case State::MetaType:
+            meta_type = b;
+            state = State::Length;
+            break;
+
+        case State::Length:
+            acc = (acc << 7) | (b & 0x7F);
+            if (++acc_bytes > 4)
+                fail(MidiErrc::LengthTooLong, "Length longer than 4 bytes");
+            if (!(b & 0x80)) {
+                payload_left = acc;
+                acc = 0;
+                acc_bytes = 0;
+                partial.clear();
+                if (payload_left)
+                    state = State::Payload;
+                else
+                    finish_payload();
+            }
+            break;
+
+        default:
+            break;
+        }
+        check_track_end();
+    }
+
+    total_consumed += pos;
+    return pos;
+}
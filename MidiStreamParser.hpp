@@ -0,0 +1,110 @@
+#ifndef MIDISTREAMPARSER_HPP_
+#define MIDISTREAMPARSER_HPP_
+
+// Push parser for midi data that arrives a piece at a time (chunked uploads etc.).
+// Bytes go in with feed(), decoded events come out with poll_events(). The parser is a
+// byte at a time state machine, so a buffer may end anywhere - in the middle of a delta
+// time, a running status message or a meta payload - and decoding just picks up where it
+// left off with the next buffer.
+//
+// Memory stays bounded whatever the file size: at most max_events events and
+// max_payload_bytes of sysex/meta payload are held between polls, and a single payload
+// longer than max_payload is truncated to that (the rest is skipped). When the event
+// queue is full feed() stops early and returns how much it consumed - poll and feed the
+// rest again.
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "MidiFile.hpp"
+
+class MidiStreamParser {
+public:
+    struct Limits {
+        size_t  max_events = 4096;
+        size_t  max_payload_bytes = 256 * 1024;  // all payloads held between two polls
+        size_t  max_payload = 64 * 1024;         // one sysex/meta payload
+    };
+
+    MidiStreamParser() : MidiStreamParser(Limits{}) {}
+    // strict: system messages other than sysex and metas, and data bytes with no status to
+    // run on, fail as in a strict MidiFile parse
+    explicit MidiStreamParser(const Limits& limits, bool strict = false);
+
+    // Returns the number of bytes consumed. Throws MidiParseError on malformed data,
+    // after which the parser stays failed. Its offset() counts the bytes fed before it.
+    size_t feed(std::span<const std::byte> bytes);
+
+    // Events decoded since the last poll, in file order. time is the absolute tick
+    // within the event's track. Valid until the next feed().
+    std::span<const MergedEvent> poll_events();
+
+    // Sysex/meta data for a polled event, same lifetime as the events
+    std::span<const std::byte> payload(const MergedEvent& e) const;
+
+    bool        header_done() const { return state > State::HeaderBody; }
+    uint16_t    format() const { return file_format; }
+    uint16_t    num_tracks() const { return declared_tracks; }
+    uint16_t    division() const { return time_division; } // raw - ppqn, or SMPTE if bit 15 is set
+    uint16_t    tracks_done() const { return finished_tracks; }
+    bool        finished() const { return header_done() && finished_tracks >= declared_tracks && state == State::ChunkId; }
+    uint64_t    bytes_consumed() const { return total_consumed; }
+
+private:
+    enum class State : uint8_t {
+        HeaderId, HeaderLength, HeaderBody,
+        ChunkId, ChunkLength, SkipChunk,
+        Delta, Status, Data1, Data2,
+        MetaType, Length, Payload,
+        Failed
+    };
+
+    bool queue_full() const;
+    [[noreturn]] void fail(MidiErrc code, const char* why);
+    void begin_event_data(uint8_t status);
+    void emit(const MidiEvent& e);
+    void finish_payload();
+    void check_track_end();
+
+    Limits                      limits;
+    bool                        strict = false;
+    State                       state = State::HeaderId;
+
+    // fixed size fields and VLQs being assembled
+    uint32_t                    acc = 0;
+    uint8_t                     acc_bytes = 0;
+
+    // header
+    uint32_t                    header_left = 0;
+    uint16_t                    file_format = 0;
+    uint16_t                    declared_tracks = 0;
+    uint16_t                    time_division = 0;
+
+    // current chunk
+    uint32_t                    chunk_id = 0;
+    uint32_t                    chunk_left = 0;
+    bool                        in_track = false;
+    uint16_t                    track = 0;
+    uint16_t                    finished_tracks = 0;
+
+    // current event
+    uint32_t                    tick = 0;
+    uint32_t                    delta = 0;
+    uint8_t                     prev_status = 0;
+    uint8_t                     status = 0;
+    uint8_t                     data1 = 0;
+    uint8_t                     meta_type = 0;
+    uint32_t                    payload_left = 0;
+    std::vector<std::byte>      partial;    // payload being collected, at most max_payload
+
+    // output, reset by the first feed() after a poll
+    std::vector<MergedEvent>    events;
+    std::vector<std::byte>      arena;
+    bool                        polled = false;
+    uint64_t                    total_consumed = 0;
+    size_t                      pos = 0;    // into the buffer being fed
+};
+
+#endif // ! MIDISTREAMPARSER_HPP_
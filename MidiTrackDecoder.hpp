@@ -0,0 +1,339 @@
+#ifndef MIDITRACKDECODER_HPP_
+#define MIDITRACKDECODER_HPP_
+
+// The track decoder, a template on the MidiParsePolicy it runs with. MidiFile.cpp compiles
+// it for the configurations MidiParseOptions can ask for - include this to parse with a
+// policy of your own:
+//
+//   MidiFile midi(bytes, MidiParsePolicy<midi_kind(MidiEvent::EventType::NoteOn) |
+//                                        midi_kind(MidiEvent::EventType::ControlChange)>{});
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "MidiDiagnostics.hpp"
+#include "MidiFile.hpp"
+#include "MidiNotePairer.hpp"
+#include "MidiScan.hpp"
+
+// Bounds checked cursor over the raw file bytes. Replaces the file.get()/seekg() pairs
+// of the stream version - every read checks against the end of the current chunk
+// so a lying length can never walk us off the end of the buffer. Errors carry the
+// offset from where the cursor started.
+struct MidiByteCursor {
+    const uint8_t* pos;
+    const uint8_t* end;
+    const uint8_t* begin;
+
+    MidiByteCursor(const uint8_t* begin, const uint8_t* end) : pos(begin), end(end), begin(begin) {}
+
+    size_t remaining() const { return static_cast<size_t>(end - pos); }
+    size_t offset() const { return static_cast<size_t>(pos - begin); }
+
+    [[noreturn]] void fail(MidiErrc code, const char* why) const {
+        throw MidiParseError(code, why, offset());
+    }
+    void need(size_t n) const {
+        if (n > remaining())
+            fail(MidiErrc::Truncated, "Unexpected end of midi data");
+    }
+    uint8_t get() {
+        need(1);
+        return *pos++;
+    }
+    void skip(size_t n) {
+        need(n);
+        pos += n;
+    }
+    // Midi files are big endian - assemble the bytes rather than read and swap
+    uint32_t get_32() {
+        need(4);
+        uint32_t v = (uint32_t(pos[0]) << 24) | (uint32_t(pos[1]) << 16) | (uint32_t(pos[2]) << 8) | pos[3];
+        pos += 4;
+        return v;
+    }
+    uint16_t get_16() {
+        need(2);
+        uint16_t v = uint16_t((pos[0] << 8) | pos[1]);
+        pos += 2;
+        return v;
+    }
+    // Some numbers like length of text and sysex will need anything from 1-4 bytes to
+    // be expressed. Only 7 bits of each byte is used to form a 7, 14, 21 or 28 bit number.
+    // read_multi_bytes does the bit shifting.
+    // DO NOT swap numbers after reading multi byte numbers...
+    uint32_t read_multi_bytes() {
+        uint32_t result = get();
+
+        // check if bit 8 is set
+        // then the up to 4 bytes may be needed to resolve the value.
+        if (result & 0x80) {
+
+            // clear bit 8, and keep reading bytes until bit 8 is zero - a fifth byte
+            // means garbage, not a bigger number
+            result &= 0x7F;
+            uint8_t bt;
+            int left = 3;
+            do {
+                if (!left--)
+                    fail(MidiErrc::LengthTooLong, "Variable length number longer than 4 bytes");
+                bt = get();
+                result = result << 7; // make place for new 7 bits
+                result |= (bt & 0x7F); // put last 7 bits. Results become 14, 21 or 28 bits
+            } while (bt & 0x80);
+        }
+        return result;
+    }
+    // Text metas are handed out as views straight into the file bytes - no copy
+    std::string_view midi_string(uint32_t length) {
+        need(length);
+        std::string_view s(reinterpret_cast<const char*>(pos), length);
+        pos += length;
+        return s;
+    }
+};
+
+
+// Strict from either side goes for all of it: the policy's strict for the header checks,
+// which go by the options, and the options' strict for the tracks, which go by the policy
+template <MidiPolicy Policy>
+MidiFile::MidiFile(std::span<const std::byte> bytes, Policy, const MidiParseOptions& options) {
+    MidiParseOptions policy_options = options;
+    policy_options.strict |= Policy::strict;
+    parse_midi_file(bytes, policy_options, decoders_for<Policy>(policy_options.strict));
+}
+
+template <MidiPolicy Policy>
+MidiFile::MidiFile(MidiFileMapping map, Policy, const MidiParseOptions& options)
+    : mapping(std::move(map))
+{
+    MidiParseOptions policy_options = options;
+    policy_options.strict |= Policy::strict;
+    parse_midi_file(mapping->bytes(), policy_options, decoders_for<Policy>(policy_options.strict));
+}
+
+template <typename Policy>
+MidiFile::TrackDecoders MidiFile::decoders_for() {
+    return { &decode_track<Policy, false>, &decode_track<Policy, true> };
+}
+
+template <typename Policy>
+MidiFile::TrackDecoders MidiFile::decoders_for(bool strict) {
+    if constexpr (!Policy::strict) {
+        if (strict)
+            return decoders_for<MidiParsePolicy<Policy::keep, Policy::storage, true>>();
+    }
+    return decoders_for<Policy>();
+}
+
+template <typename Policy, bool Instrumented>
+void MidiFile::decode_track(std::span<const std::byte> bytes, MidiTrack& track, const MidiParseOptions& options,
+                            std::vector<TempoChange>& tempo_changes, MidiNotePairer& pairer, MidiTrackStats* stats) {
+
+    using Type = MidiEvent::EventType;
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(bytes.data());
+    MidiByteCursor chunk{ data, data + bytes.size() };
+
+    // Every message moves the clock, only the kept ones are stored - with their delta from
+    // the last stored event, so a dropped message leaves nothing behind
+    uint32_t tick = 0;
+    uint32_t stored_tick = 0;
+    if constexpr (Policy::pair_notes)
+        pairer.start_track(track.notes);
+    auto emit = [&](MidiEvent e) {
+        e.delta_time = tick - stored_tick;
+        stored_tick = tick;
+        if constexpr (Policy::storage == MidiEventStorage::Columns)
+            track.columns.push_back(tick, e);
+        else
+            track.events.push_back(e);
+    };
+
+    // sysex and text payloads are copied into the track's arena
+    auto add_payload = [&track](std::string_view bytes) {
+        uint32_t offset = static_cast<uint32_t>(track.payloads.size());
+        uint32_t length = static_cast<uint32_t>(bytes.size());
+        track.payloads.resize(offset + sizeof(length) + length);
+        std::memcpy(track.payloads.data() + offset, &length, sizeof(length));
+        std::memcpy(track.payloads.data() + offset + sizeof(length), bytes.data(), length);
+        return offset;
+    };
+
+    // Only called for status bytes in Policy::decodes - the others are skipped by length
+    auto channel_message = [&](uint8_t status, uint8_t data1, uint8_t data2) {
+        auto type = midi_event_type(status, data1, data2);
+        uint8_t channel = status & 0x0F;
+        if constexpr (Policy::pair_notes) {
+            if (type == Type::NoteOn)
+                pairer.note_on(channel, data1, data2, tick);
+            else if (type == Type::NoteOff)
+                pairer.note_off(channel, data1, tick);
+        }
+        if (Policy::keeps(type))
+            emit({ type, 0, data1, data2, channel });
+    };
+
+    bool end_of_track = false;
+    uint8_t prev_status = 0; // needed for "running state" where several midi events share a previous status
+
+    while (chunk.remaining() && !end_of_track)
+    {
+        // Runs of channel messages go through the block scanner: one mask of the top bits
+        // of the next 64 bytes gives every delta time terminator and status byte, and the
+        // number of data bytes comes from a table. Sysex, meta and anything odd leave the
+        // run and get one trip through the byte by byte decode below. A policy that decodes
+        // no channel messages at all skips the scanner: stepping over them one by one is
+        // cheaper than setting up a block for nothing.
+        while (Policy::decodes_channel && chunk.remaining() >= midi_scan_block) {
+            const uint8_t* p = chunk.pos;
+            uint64_t high = midi_high_bits(p);
+            size_t at = 0;
+
+            // the longest channel message is 4 delta time bytes, status and 2 data bytes
+            constexpr size_t last_start = midi_scan_block - 7;
+            while (at <= last_start) {
+                uint64_t bits = high >> at;
+                size_t delta_bytes = static_cast<size_t>(std::countr_one(bits)) + 1;
+                if (delta_bytes > 4)
+                    break;
+                uint32_t delta_time = 0;
+                for (size_t i = 0; i < delta_bytes; ++i)
+                    delta_time = (delta_time << 7) | (p[at + i] & 0x7F);
+
+                size_t pos = at + delta_bytes;
+                uint8_t status = ((bits >> delta_bytes) & 1) ? p[pos++] : prev_status;
+                uint8_t num_data = midi_data_length[status];
+                if (num_data == midi_variable_length || ((high >> pos) & ((1u << num_data) - 1)))
+                    break;
+                if constexpr (Instrumented) {
+                    ++stats->opcodes[status >> 4];
+                    stats->running_status += !((bits >> delta_bytes) & 1);
+                }
+                at = pos + num_data;
+                prev_status = status;
+                tick += delta_time;
+                if (Policy::decodes[status])
+                    channel_message(status, p[pos], num_data == 2 ? p[pos + 1] : 0);
+            }
+            chunk.pos += at;
+            if (at <= last_start)
+                break; // stopped on something the scanner doesn't handle
+        }
+        if (!chunk.remaining())
+            break;
+
+        uint32_t delta_time = chunk.read_multi_bytes(); // DO NOT SWAP the decoded multi bytes
+        uint8_t status = chunk.get();
+
+        // check if running state and restore previous status if so
+        if (status < 0x80) { // this is not a status byte - but midi event data
+            // move back a position or else the next reads will be off
+            --chunk.pos;
+            status = prev_status;
+            if constexpr (Instrumented)
+                ++stats->running_status;
+        }
+        if constexpr (Instrumented)
+            ++stats->opcodes[status >> 4];
+        tick += delta_time;
+
+        if (status >= 0x80 && status < 0xF0) { // channel messages
+            prev_status = status;
+            uint8_t data1 = chunk.get();
+            uint8_t data2 = midi_data_length[status] == 2 ? chunk.get() : 0;
+            if constexpr (Policy::strict)
+                if ((data1 | data2) & 0x80)
+                    chunk.fail(MidiErrc::BadData, "Status byte where a data byte was due");
+            if (Policy::decodes[status])
+                channel_message(status, data1, data2);
+        }
+        else if (status == 0xF0 || status == 0xF7) { // System exclusive (plain or escaped)
+            prev_status = 0;
+            std::string_view payload = chunk.midi_string(chunk.read_multi_bytes());
+            if constexpr (Policy::keeps(Type::SysEx))
+                emit({ Type::SysEx, 0, 0, 0, 0, status, add_payload(payload) });
+        }
+        else if (status > 0xF0) { // Meta event - all of them are FF type length data
+            // (other system messages don't belong in a file, they are read as one too)
+            if constexpr (Policy::strict)
+                if (status != 0xFF)
+                    chunk.fail(MidiErrc::SystemMessage, "System message in a track");
+            prev_status = 0;
+            uint8_t  type = chunk.get();
+            uint32_t length = chunk.read_multi_bytes();
+            std::string_view tmp_string = chunk.midi_string(length);
+            auto payload = reinterpret_cast<const uint8_t*>(tmp_string.data());
+
+            switch (type) {
+            case 0x02: // copyright: FF 02 multibytelength <string>
+                track.copyright = tmp_string;
+                break;
+            case 0x03: // FF 03 length text Track or sequence name.
+                track.name = tmp_string;
+                break;
+            case 0x04: // Instrument name
+                track.instrument = tmp_string;
+                break;
+            case 0x21: // FF 21 01 pp Midi Port
+                if (length >= 1)
+                    track.port = payload[0];
+                break;
+            case 0x2F: // FF 2F 00 End of track
+                end_of_track = true;
+                break;
+            }
+
+            // tempo, time and key signature are small enough to live in the event itself
+            if (type == 0x51 && length >= 3) { // FF 51 03 tt tt tt tempo - always read, timing needs it
+                uint32_t tempo = (payload[0] << 16) | (payload[1] << 8) | payload[2];
+                tempo_changes.push_back({ tick, tempo });
+                if constexpr (Policy::keeps(Type::Tempo))
+                    emit({ Type::Tempo, 0, 0, 0, 0, type, tempo });
+            }
+            else if (type == 0x58 && length >= 4) { // FF 58 04 nn dd cc bb - Time signature
+                if constexpr (Policy::keeps(Type::TimeSignature))
+                    emit({ Type::TimeSignature, 0, 0, 0, 0, type,
+                           (uint32_t(payload[0]) << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3] });
+            }
+            else if (type == 0x59 && length >= 2) { // FF 59 02 sf mi - Key signature
+                if constexpr (Policy::keeps(Type::KeySignature))
+                    emit({ Type::KeySignature, 0, 0, 0, 0, type, uint32_t((payload[0] << 8) | payload[1]) });
+            }
+            else { // text, markers, sequencer specific etc.
+                if constexpr (Policy::strict)
+                    if (type == 0x51 || type == 0x58 || type == 0x59)
+                        chunk.fail(MidiErrc::ShortMeta, "Meta event too short for its type");
+                if constexpr (Policy::keeps(Type::Meta))
+                    emit({ Type::Meta, 0, 0, 0, 0, type, add_payload(tmp_string) });
+            }
+        }
+        else { // data byte with no running status to go with it
+            if constexpr (Policy::strict)
+                chunk.fail(MidiErrc::MissingStatus, "Running status without a previous status byte");
+            else if (options.diagnostics)
+                options.diagnostics->warning("Running status without a previous status byte");
+        }
+    } // end loop track events
+
+    if constexpr (Policy::strict) {
+        if (!end_of_track)
+            chunk.fail(MidiErrc::MissingEndOfTrack, "Track without an end of track");
+        if (chunk.remaining())
+            chunk.fail(MidiErrc::DataAfterEndOfTrack, "Data after the end of track");
+    }
+
+    if constexpr (Policy::pair_notes)
+        pairer.finish_track(tick, options.dangling_notes);
+
+    if constexpr (Instrumented) {
+        stats->chunk_bytes = bytes.size();
+        stats->bytes = static_cast<uint64_t>(chunk.pos - data);
+        stats->events = track.event_count();
+    }
+}
+
+#endif // ! MIDITRACKDECODER_HPP_
@@ -0,0 +1,236 @@
+
+#include "MidiWriter.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include <system_error>
+
+
+namespace {
+
+    // The events of one track with their absolute ticks
+    struct TrackEvents {
+        const MidiTrack& track;
+
+        template <typename F>
+        void for_each(F&& f) const {
+            uint32_t tick = 0;
+            for (size_t i = 0, n = track.event_count(); i < n; ++i) {
+                MidiEvent e = track.event_at(i);
+                tick += e.delta_time;
+                f(tick, e, track.payload(e));
+            }
+        }
+    };
+
+    // A merged stream, payloads from the track each event came from
+    struct MergedEvents {
+        std::span<const MergedEvent>    events;
+        std::span<const MidiTrack>      tracks;
+
+        template <typename F>
+        void for_each(F&& f) const {
+            for (const auto& m : events) {
+                auto payload = m.track < tracks.size() ? tracks[m.track].payload(m.event) : std::span<const std::byte>{};
+                f(m.time, m.event, payload);
+            }
+        }
+    };
+
+    // Feeds the encoded bytes of a track to put_byte/put_bytes. Run once to size the
+    // chunk and once to write it, so both see exactly the same bytes.
+    template <typename Events, typename PutByte, typename PutBytes>
+    void encode_events(const Events& events, PutByte&& put_byte, PutBytes&& put_bytes) {
+        auto vlq = [&](uint32_t v) {
+            uint8_t buf[5];
+            size_t n = 0;
+            do {
+                buf[n++] = v & 0x7F;
+                v >>= 7;
+            } while (v);
+            while (n-- > 1)
+                put_byte(uint8_t(buf[n] | 0x80));
+            put_byte(buf[0]);
+        };
+        auto meta = [&](uint8_t type, std::initializer_list<uint8_t> data) {
+            put_byte(0xFF);
+            put_byte(type);
+            vlq(static_cast<uint32_t>(data.size()));
+            for (uint8_t b : data)
+                put_byte(b);
+        };
+
+        uint32_t last = 0;      // tick of the last event written
+        uint32_t end = 0;       // where the end of track goes
+        uint8_t running = 0;    // status byte in effect
+
+        events.for_each([&](uint32_t tick, const MidiEvent& e, std::span<const std::byte> payload) {
+            end = std::max(end, tick);
+            if (e.event == MidiEvent::EventType::Other || (e.event == MidiEvent::EventType::Meta && e.meta == 0x2F))
+                return; // left out, end of track is written once at the end
+
+            vlq(tick - last);
+            last = tick;
+
+            switch (e.event) {
+            case MidiEvent::EventType::SysEx:
+                running = 0; // sysex and meta cancel running status
+                put_byte(e.meta);
+                vlq(static_cast<uint32_t>(payload.size()));
+                put_bytes(payload);
+                break;
+            case MidiEvent::EventType::Meta:
+                running = 0;
+                put_byte(0xFF);
+                put_byte(e.meta);
+                vlq(static_cast<uint32_t>(payload.size()));
+                put_bytes(payload);
+                break;
+            case MidiEvent::EventType::Tempo:
+                running = 0;
+                meta(0x51, { uint8_t(e.payload >> 16), uint8_t(e.payload >> 8), uint8_t(e.payload) });
+                break;
+            case MidiEvent::EventType::TimeSignature:
+                running = 0;
+                meta(0x58, { uint8_t(e.payload >> 24), uint8_t(e.payload >> 16), uint8_t(e.payload >> 8), uint8_t(e.payload) });
+                break;
+            case MidiEvent::EventType::KeySignature:
+                running = 0;
+                meta(0x59, { uint8_t(e.payload >> 8), uint8_t(e.payload) });
+                break;
+            default: {
+                // A note off with velocity 0 reads back the same as a note on with velocity
+                // 0 - and that one can share the running status of the note ons around it
+                uint8_t status = midi_event_status(e);
+                if (e.event == MidiEvent::EventType::NoteOff && e.velocity == 0)
+                    status = 0x90 | (e.channel & 0x0F);
+                if (status != running) {
+                    put_byte(status);
+                    running = status;
+                }
+                put_byte(e.note & 0x7F);
+                if (e.event != MidiEvent::EventType::ProgramChange && e.event != MidiEvent::EventType::ChannelPressure)
+                    put_byte(e.velocity & 0x7F);
+                break;
+            }
+            }
+        });
+
+        vlq(end - last);
+        put_byte(0xFF);
+        put_byte(0x2F);
+        put_byte(0x00);
+    }
+}
+
+
+MidiWriter::MidiWriter(Sink sink, size_t buffer_size)
+    : sink(std::move(sink))
+    , buffer(std::max<size_t>(buffer_size, 16))
+{
+}
+
+MidiWriter::MidiWriter(std::ostream& out, size_t buffer_size)
+    : MidiWriter([&out](std::span<const std::byte> bytes) {
+                     out.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+                 }, buffer_size)
+{
+}
+
+void MidiWriter::flush() {
+    if (used) {
+        sink({ buffer.data(), used });
+        total += used;
+        used = 0;
+    }
+}
+
+void MidiWriter::put(std::span<const std::byte> bytes) {
+    if (bytes.size() > buffer.size() - used) {
+        flush();
+        // too big for the buffer anyway - straight through, no copy
+        if (bytes.size() >= buffer.size()) {
+            sink(bytes);
+            total += bytes.size();
+            return;
+        }
+    }
+    std::memcpy(buffer.data() + used, bytes.data(), bytes.size());
+    used += bytes.size();
+}
+
+void MidiWriter::put_32(uint32_t v) {
+    put(uint8_t(v >> 24));
+    put(uint8_t(v >> 16));
+    put(uint8_t(v >> 8));
+    put(uint8_t(v));
+}
+
+void MidiWriter::write_header(uint16_t format, uint16_t num_tracks, uint16_t division) {
+    for (char c : { 'M', 'T', 'h', 'd' })
+        put(uint8_t(c));
+    put_32(6);
+    put(uint8_t(format >> 8));
+    put(uint8_t(format));
+    put(uint8_t(num_tracks >> 8));
+    put(uint8_t(num_tracks));
+    put(uint8_t(division >> 8));
+    put(uint8_t(division));
+}
+
+template <typename Events>
+void MidiWriter::write_track(const Events& events) {
+    uint64_t length = 0;
+    encode_events(events, [&length](uint8_t) { ++length; },
+                          [&length](std::span<const std::byte> bytes) { length += bytes.size(); });
+    if (length > UINT32_MAX)
+        throw std::length_error("Track too long for a midi file");
+
+    for (char c : { 'M', 'T', 'r', 'k' })
+        put(uint8_t(c));
+    put_32(static_cast<uint32_t>(length));
+    encode_events(events, [this](uint8_t b) { put(b); },
+                          [this](std::span<const std::byte> bytes) { put(bytes); });
+}
+
+void MidiWriter::write(std::span<const MidiTrack> tracks, uint16_t division) {
+    if (tracks.size() > UINT16_MAX)
+        throw std::length_error("Too many tracks for a midi file");
+    write_header(tracks.size() == 1 ? 0 : 1, static_cast<uint16_t>(tracks.size()), division);
+    for (const auto& t : tracks)
+        write_track(TrackEvents{ t });
+    flush();
+}
+
+void MidiWriter::write(const MidiFile& midi) {
+    midi.decode_all();
+    write(midi.tracks, midi.division());
+}
+
+void MidiWriter::write_merged(std::span<const MergedEvent> events, std::span<const MidiTrack> tracks, uint16_t division) {
+    write_header(0, 1, division);
+    write_track(MergedEvents{ events, tracks });
+    flush();
+}
+
+void MidiWriter::write_merged(const MidiFile& midi) {
+    midi.decode_all();
+    write_merged(midi.merged_events(), midi.tracks, midi.division());
+}
+
+
+void midi_write_file(const MidiFile& midi, const std::string& path, bool merged) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw std::system_error(std::make_error_code(std::errc::io_error), "Could not open " + path);
+    MidiWriter writer(out);
+    if (merged)
+        writer.write_merged(midi);
+    else
+        writer.write(midi);
+    out.flush();
+    if (!out)
+        throw std::system_error(std::make_error_code(std::errc::io_error), "Could not write " + path);
+}
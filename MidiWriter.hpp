@@ -0,0 +1,70 @@
+#ifndef MIDIWRITER_HPP_
+#define MIDIWRITER_HPP_
+
+// Writes midi data back out as a standard midi file, format 1 (a track per MidiTrack) or
+// format 0 (everything merged into one track).
+//
+// Output is compact: running status wherever two channel messages in a row share a status
+// byte (a note off with velocity 0 goes out as a note on, so it shares the status of the
+// notes around it), and every delta time and length in as few VLQ bytes as it takes.
+//
+// Bytes go through one fixed size buffer to the sink, payloads too big for it go to the
+// sink directly. MTrk lengths come from a sizing pass over the events, so nothing is
+// built up in memory and the sink never has to seek.
+//
+// Other events (not messages, the parser never stores one) are skipped, their
+// delta time carried over to the next event. Each track gets exactly one end of track.
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "MidiFile.hpp"
+
+class MidiWriter {
+public:
+    using Sink = std::function<void(std::span<const std::byte>)>;
+
+    explicit MidiWriter(Sink sink, size_t buffer_size = 64 * 1024);
+    explicit MidiWriter(std::ostream& out, size_t buffer_size = 64 * 1024);
+
+    // Format 1 - format 0 if there is just one track
+    void write(const MidiFile& midi);
+    void write(std::span<const MidiTrack> tracks, uint16_t division);
+
+    // Format 0: all tracks in one. An edited merged stream works too, as long as it is in
+    // time order - sysex and meta payloads are looked up in tracks[e.track].
+    void write_merged(const MidiFile& midi);
+    void write_merged(std::span<const MergedEvent> events, std::span<const MidiTrack> tracks, uint16_t division);
+
+    void flush();
+    uint64_t bytes_written() const { return total + used; }
+
+private:
+    template <typename Events>
+    void write_track(const Events& events);
+    void write_header(uint16_t format, uint16_t num_tracks, uint16_t division);
+
+    void put(uint8_t b) {
+        if (used == buffer.size())
+            flush();
+        buffer[used++] = std::byte{ b };
+    }
+    void put(std::span<const std::byte> bytes);
+    void put_32(uint32_t v);
+
+    Sink                    sink;
+    std::vector<std::byte>  buffer;
+    size_t                  used = 0;
+    uint64_t                total = 0;  // flushed so far
+};
+
+// midi written to path, format 1 (or format 0 with merged). Throws std::system_error
+// if the file can't be written.
+void midi_write_file(const MidiFile& midi, const std::string& path, bool merged = false);
+
+#endif // ! MIDIWRITER_HPP_
@@ -0,0 +1,72 @@
+#ifndef SPSCRING_HPP_
+#define SPSCRING_HPP_
+
+// Bounded lock free queue for exactly one producer thread and one consumer thread.
+// All storage is allocated up front, push and pop never allocate or block.
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+template <typename T>
+class SpscRing {
+    static_assert(std::is_trivially_copyable_v<T>, "SpscRing copies slots around with no ceremony");
+
+public:
+    // Capacity is rounded up to a power of two so the index wrap is a mask
+    explicit SpscRing(size_t capacity) {
+        size_t cap = 2;
+        while (cap < capacity)
+            cap <<= 1;
+        mask = cap - 1;
+        slots = std::make_unique<T[]>(cap);
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+    // Producer side. False if the ring is full.
+    bool push(const T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - cached_head > mask) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (t - cached_head > mask)
+                return false;
+        }
+        slots[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. False if the ring is empty.
+    bool pop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h == cached_tail)
+                return false;
+        }
+        item = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+private:
+    // Producer and consumer indices on their own cache lines so they don't ping-pong.
+    // Each side also caches the other's index and only rereads it when it has to.
+    static constexpr size_t cache_line = 64;
+
+    alignas(cache_line) std::atomic<size_t> tail{ 0 };
+    size_t                                  cached_head = 0; // producer's copy of head
+    alignas(cache_line) std::atomic<size_t> head{ 0 };
+    size_t                                  cached_tail = 0; // consumer's copy of tail
+    alignas(cache_line) size_t              mask = 0;
+    std::unique_ptr<T[]>                    slots;
+};
+
+#endif // ! SPSCRING_HPP_
@@ -0,0 +1,148 @@
+
+#include "TempoMap.hpp"
+#include "MidiFile.hpp"
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <type_traits>
+
+
+TempoMap::TempoMap()
+    : TempoMap(96, {})
+{
+}
+
+TempoMap::TempoMap(uint16_t ppqn, std::vector<TempoChange> changes) {
+
+    if (ppqn == 0)
+        ppqn = 96; // a broken header shouldn't give us a division by zero
+
+    std::stable_sort(changes.begin(), changes.end(), [](const TempoChange& a, const TempoChange& b) {
+        return a.tick < b.tick;
+    });
+
+    // Until the first tempo event the standard says 120 bpm
+    segs.push_back({ 0, 0.0, 500000 / 1e6 / ppqn });
+
+    for (const auto& c : changes) {
+        double seconds_per_tick = c.microseconds_per_quarter / 1e6 / ppqn;
+        Segment& last = segs.back();
+        if (c.tick == last.tick)
+            last.seconds_per_tick = seconds_per_tick; // same tick - the later one wins
+        else
+            segs.push_back({ c.tick, last.seconds + (c.tick - last.tick) * last.seconds_per_tick, seconds_per_tick });
+    }
+}
+
+TempoMap TempoMap::smpte(uint16_t fps, uint16_t ticks_per_frame) {
+    TempoMap map;
+    double frames_per_second = fps == 29 ? 29.97 : fps;
+    if (frames_per_second <= 0.0 || ticks_per_frame == 0)
+        return map;
+    map.segs = { { 0, 0.0, 1.0 / (frames_per_second * ticks_per_frame) } };
+    return map;
+}
+
+TempoMap TempoMap::from_segments(std::span<const Segment> segments) {
+    TempoMap map;
+    if (!segments.empty())
+        map.segs.assign(segments.begin(), segments.end());
+    return map;
+}
+
+size_t TempoMap::segment_index(uint32_t tick) const {
+    // first segment starting after tick, the one before it holds tick
+    auto it = std::upper_bound(segs.begin(), segs.end(), tick, [](uint32_t t, const Segment& s) {
+        return t < s.tick;
+    });
+    return static_cast<size_t>(it - segs.begin()) - 1;
+}
+
+double TempoMap::seconds(uint32_t tick) const {
+    const Segment& s = segs[segment_index(tick)];
+    return s.seconds + (tick - s.tick) * s.seconds_per_tick;
+}
+
+uint32_t TempoMap::tick(double seconds) const {
+    if (seconds <= 0.0)
+        return 0;
+    auto it = std::upper_bound(segs.begin(), segs.end(), seconds, [](double t, const Segment& s) {
+        return t < s.seconds;
+    });
+    const Segment& s = *(it - 1);
+    double ticks = s.tick + (seconds - s.seconds) / s.seconds_per_tick;
+    return ticks >= std::numeric_limits<uint32_t>::max() ? std::numeric_limits<uint32_t>::max() : static_cast<uint32_t>(ticks);
+}
+
+void TempoMap::seconds(std::span<const uint32_t> ticks, std::span<double> out) const {
+    assert(out.size() >= ticks.size());
+
+    size_t idx = 0;
+    for (size_t i = 0; i < ticks.size(); ++i) {
+        uint32_t t = ticks[i];
+        if (t >= segs[idx].tick) {
+            while (idx + 1 < segs.size() && segs[idx + 1].tick <= t)
+                ++idx;
+        }
+        else
+            idx = segment_index(t); // went backwards - unsorted input
+        out[i] = segs[idx].seconds + (t - segs[idx].tick) * segs[idx].seconds_per_tick;
+    }
+}
+
+template <typename Note>
+void TempoMap::note_seconds(std::span<const Note> notes, std::span<MidiNoteTime> out) const {
+    assert(out.size() >= notes.size());
+
+    size_t idx = 0;
+    for (size_t i = 0; i < notes.size(); ++i) {
+        const MidiNote& n = [&]() -> const MidiNote& {
+            if constexpr (std::is_same_v<Note, MergedNote>)
+                return notes[i].note;
+            else
+                return notes[i];
+        }();
+
+        uint32_t start = n.start_time;
+        if (start >= segs[idx].tick) {
+            while (idx + 1 < segs.size() && segs[idx + 1].tick <= start)
+                ++idx;
+        }
+        else
+            idx = segment_index(start);
+
+        const Segment& s = segs[idx];
+        double start_seconds = s.seconds + (start - s.tick) * s.seconds_per_tick;
+
+        // most notes end before the next tempo change
+        uint64_t end64 = uint64_t(start) + n.duration;
+        uint32_t end = end64 > std::numeric_limits<uint32_t>::max() ? std::numeric_limits<uint32_t>::max() : static_cast<uint32_t>(end64);
+        double end_seconds;
+        if (idx + 1 == segs.size() || end < segs[idx + 1].tick)
+            end_seconds = s.seconds + (end - s.tick) * s.seconds_per_tick;
+        else
+            end_seconds = seconds(end);
+
+        out[i] = { start_seconds, end_seconds - start_seconds };
+    }
+}
+
+void TempoMap::seconds(std::span<const MidiNote> notes, std::span<MidiNoteTime> out) const {
+    note_seconds(notes, out);
+}
+
+void TempoMap::seconds(std::span<const MergedNote> notes, std::span<MidiNoteTime> out) const {
+    note_seconds(notes, out);
+}
+
+std::vector<MidiNoteTime> TempoMap::seconds(std::span<const MidiNote> notes) const {
+    std::vector<MidiNoteTime> out(notes.size());
+    note_seconds(notes, std::span<MidiNoteTime>(out));
+    return out;
+}
+
+std::vector<MidiNoteTime> TempoMap::seconds(std::span<const MergedNote> notes) const {
+    std::vector<MidiNoteTime> out(notes.size());
+    note_seconds(notes, std::span<MidiNoteTime>(out));
+    return out;
+}
@@ -0,0 +1,66 @@
+#ifndef TEMPOMAP_HPP_
+#define TEMPOMAP_HPP_
+
+// Converts midi ticks to seconds. For metrical files (ppqn) the tempo changes split the
+// timeline into segments of constant seconds-per-tick. Each segment knows the absolute
+// time it starts at, so a lookup is a binary search plus one multiply-add.
+// SMPTE files have a fixed number of ticks per second and just one segment.
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+struct MidiNote;
+struct MergedNote;
+
+// A FF 51 tempo event at an absolute tick
+struct TempoChange {
+    uint32_t    tick = 0;
+    uint32_t    microseconds_per_quarter = 500000;
+};
+
+// A note's start and duration in seconds
+struct MidiNoteTime {
+    double      start = 0.0;
+    double      duration = 0.0;
+};
+
+class TempoMap {
+public:
+    struct Segment {
+        uint32_t    tick = 0;               // first tick of the segment
+        double      seconds = 0.0;          // absolute time at that tick
+        double      seconds_per_tick = 0.0;
+    };
+
+    // 120 bpm at 96 ppqn until told otherwise
+    TempoMap();
+    // Metrical time. Changes need not be sorted, the last one wins if several share a tick.
+    TempoMap(uint16_t ppqn, std::vector<TempoChange> changes);
+    // SMPTE time: frames per second (29 means 29.97 drop frame) and ticks per frame
+    static TempoMap smpte(uint16_t fps, uint16_t ticks_per_frame);
+    // Back from segments() of another map, e.g. a cached one. Must not be empty.
+    static TempoMap from_segments(std::span<const Segment> segments);
+
+    double seconds(uint32_t tick) const;
+    uint32_t tick(double seconds) const; // the last tick at or before seconds
+
+    // Batch versions for whole arrays. Sorted input (the usual case) walks the segments
+    // alongside instead of searching, unsorted input still works.
+    void seconds(std::span<const uint32_t> ticks, std::span<double> out) const;
+    void seconds(std::span<const MidiNote> notes, std::span<MidiNoteTime> out) const;
+    void seconds(std::span<const MergedNote> notes, std::span<MidiNoteTime> out) const;
+    std::vector<MidiNoteTime> seconds(std::span<const MidiNote> notes) const;
+    std::vector<MidiNoteTime> seconds(std::span<const MergedNote> notes) const;
+
+    const std::vector<Segment>& segments() const { return segs; }
+
+private:
+    size_t segment_index(uint32_t tick) const;
+    template <typename Note>
+    void note_seconds(std::span<const Note> notes, std::span<MidiNoteTime> out) const;
+
+    std::vector<Segment> segs; // never empty, segs[0].tick == 0
+};
+
+#endif // ! TEMPOMAP_HPP_